@@ -0,0 +1,337 @@
+/*
+@author: Michael Rohs
+@date: January 19, 2022
+*/
+
+#define NO_DEBUG
+// #define NO_ASSERT
+// #define NO_REQUIRE
+// #define NO_ENSURE
+
+#include <stdint.h>
+#include <pthread.h>
+#include "util.h"
+#include "ctrie.h"
+
+/*
+A variant of the trie in trie.d.c that may be read concurrently with updates.
+Readers do not take locks. They load slots with acquire semantics. Writers are
+serialized by a mutex. A writer fully initializes new nodes before it publishes
+them with a release store, so a reader either sees the old slot value or the
+complete new subtree. Nodes that are unlinked by a writer are not freed
+immediately, because a reader may still be traversing them. They are retired
+and freed once every reader that might have seen them has left its read-side
+critical section (epoch-based reclamation).
+*/
+
+#define is_value(t) (((t) & 1) == 0)
+#define is_node(t) (((t) & 1) == 1)
+#define is_empty(t) ((t) == 0)
+#define bit_count 4
+#define slot_count (1 << (bit_count))
+#define bit_mask ((slot_count) - 1)
+
+#define load(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define publish(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+// Maximum number of threads that may read a concurrent trie at the same time.
+#define READERS_MAX 256
+
+// Number of retired nodes that triggers an attempt to reclaim them.
+#define RETIRED_THRESHOLD 64
+
+typedef struct Node Node
+struct Node
+    uint64_t slots[slot_count]
+    Node* next_retired // link in the list of retired nodes
+    uint64_t retire_epoch // global epoch at the time the node was unlinked
+
+/*
+The global epoch is advanced by writers when they try to reclaim retired nodes.
+A reader announces the epoch it entered in reader_epochs (0 means that the
+reader is not in a read-side critical section). A thread claims a reader slot on
+its first read and releases it when it exits (or calls ctrie_release_reader), so
+the slot can be reused by another thread.
+*/
+uint64_t global_epoch = 1
+uint64_t reader_epochs[READERS_MAX]
+bool reader_used[READERS_MAX]
+__thread int reader_index = -1
+__thread int read_depth = 0
+
+// Releases the reader slot of an exiting thread (thread-local destructor).
+pthread_key_t reader_key
+pthread_once_t reader_key_once = PTHREAD_ONCE_INIT
+
+// Serializes writers. Also protects the list of retired nodes.
+pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER
+Node* retired = NULL
+int retired_count = 0
+
+Node* new_node(void)
+    return xcalloc(1, sizeof(Node))
+
+void release_reader_slot(void* slot)
+    int i = (int)(intptr_t)slot - 1
+    assert("valid slot", i >= 0 && i < READERS_MAX)
+    __atomic_store_n(reader_epochs + i, 0, __ATOMIC_SEQ_CST)
+    __atomic_store_n(reader_used + i, false, __ATOMIC_RELEASE)
+
+void create_reader_key(void)
+    int err = pthread_key_create(&reader_key, release_reader_slot)
+    require("key created", err == 0)
+
+// Claims a free reader slot for the calling thread.
+void claim_reader_slot(void)
+    pthread_once(&reader_key_once, create_reader_key)
+    for int i = 0; i < READERS_MAX; i++ do
+        bool expected = false
+        if !load(reader_used + i) && __atomic_compare_exchange_n(reader_used + i, &expected, true, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) do
+            reader_index = i
+            pthread_setspecific(reader_key, (void*)(intptr_t)(i + 1))
+            return
+    require("not too many readers", false)
+
+/*
+Enters a read-side critical section. Nodes that are reachable from a trie when
+the section is entered are not freed before the section is left. Sections may
+be nested.
+*/
+*void ctrie_read_begin(void)
+    if read_depth++ > 0 do return
+    if reader_index < 0 do claim_reader_slot()
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST)
+    __atomic_store_n(reader_epochs + reader_index, epoch, __ATOMIC_SEQ_CST)
+    // store-load barrier: the announcement has to be visible before the first
+    // slot is loaded (pairs with the fence in reclaim_locked)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+// Leaves a read-side critical section.
+*void ctrie_read_end(void)
+    require("in read section", read_depth > 0)
+    if --read_depth > 0 do return
+    __atomic_store_n(reader_epochs + reader_index, 0, __ATOMIC_RELEASE)
+
+/*
+Releases the reader slot of the calling thread, so that another thread can use
+it. Happens automatically when the thread exits. The thread may read again
+later; it then claims a new slot.
+*/
+*void ctrie_release_reader(void)
+    require("not in read section", read_depth == 0)
+    if reader_index < 0 do return
+    pthread_setspecific(reader_key, NULL)
+    release_reader_slot((void*)(intptr_t)(reader_index + 1))
+    reader_index = -1
+
+/*
+Frees the retired nodes that no reader can access anymore. A node that has been
+retired in epoch e may be referenced only by readers that announced an epoch
+less than or equal to e. Must be called with the writer lock held.
+*/
+void reclaim_locked(void)
+    __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST)
+    // store-load barrier: the unlinking stores have to be visible before the
+    // reader epochs are loaded (pairs with the fence in ctrie_read_begin)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST)
+    uint64_t min_epoch = UINT64_MAX
+    for int i = 0; i < READERS_MAX; i++ do
+        uint64_t e = __atomic_load_n(reader_epochs + i, __ATOMIC_SEQ_CST)
+        if e != 0 && e < min_epoch do min_epoch = e
+    Node** pn = &retired
+    while *pn != NULL do
+        Node* node = *pn
+        if node->retire_epoch < min_epoch do
+            *pn = node->next_retired
+            free(node)
+            retired_count--
+        else
+            pn = &node->next_retired
+    PLf("retired_count = %d, min_epoch = %llu", retired_count, min_epoch)
+
+// Retires a node that has been unlinked. Must be called with the writer lock held.
+void retire_locked(Node* node)
+    require_not_null(node)
+    node->retire_epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST)
+    node->next_retired = retired
+    retired = node
+    retired_count++
+
+void unlock(void)
+    if retired_count >= RETIRED_THRESHOLD do reclaim_locked()
+    pthread_mutex_unlock(&writer_lock)
+
+// Frees the retired nodes that are no longer accessed by any reader.
+*void ctrie_reclaim(void)
+    pthread_mutex_lock(&writer_lock)
+    reclaim_locked()
+    pthread_mutex_unlock(&writer_lock)
+
+// Returns the number of nodes that have been retired, but not freed yet.
+*int ctrie_retired_count(void)
+    pthread_mutex_lock(&writer_lock)
+    int n = retired_count
+    pthread_mutex_unlock(&writer_lock)
+    return n
+
+*bool ctrie_is_empty(uint64_t* t)
+    require_not_null(t)
+    return is_empty(load(t))
+
+*void ctrie_insert(uint64_t* t, uint64_t x, int level)
+    require_not_null(t)
+    require("not null", x != 0)
+    require("is value", is_value(x))
+    require("not negative", level >= 0)
+    pthread_mutex_lock(&writer_lock)
+    loop:
+    uint64_t y = *t // only writers modify slots, no need to synchronize
+    PLf("t = %p, y = %llx, x = %llx, level = %d", t, y, x, level)
+    if is_empty(y) do
+        // empty trie, set x
+        publish(t, x)
+    else if is_node(y) do
+        // tree is a node (LSB set)
+        Node* node = (Node*)(y & ~1)
+        int i = (x >> (bit_count * level)) & bit_mask
+        t = node->slots + i; level += 1
+        goto loop // avoid recursion
+    else if x != y do
+        assert("valid y", !is_empty(y) && is_value(y))
+        // slot contains value y that needs to be moved down, build the new
+        // subtree privately and publish it as a whole
+        Node* top = new_node()
+        Node* node = top
+        while (true)
+            int i = (x >> (bit_count * level)) & bit_mask
+            int j = (y >> (bit_count * level)) & bit_mask
+            if i != j do
+                node->slots[i] = x
+                node->slots[j] = y
+                break
+            else
+                Node* next = new_node()
+                node->slots[i] = (uint64_t)next | 1
+                node = next
+                level++
+        publish(t, (uint64_t)top | 1)
+    // else: value already in trie, do nothing
+    unlock()
+
+/*
+Checks whether x is contained in trie t. Does not block and may run concurrently
+with insertions and removals.
+*/
+*bool ctrie_contains(uint64_t* t, uint64_t x, int level)
+    require_not_null(t)
+    if x == 0 do return false
+    require("is value", is_value(x))
+    require("not negative", level >= 0)
+    ctrie_read_begin()
+    uint64_t y = load(t)
+    bool found = false
+    while (true)
+        if is_empty(y) do
+            break
+        else if x == y do
+            found = true
+            break
+        else if is_node(y) do
+            Node* node = (Node*)(y & ~1) // clear marker bit (LSB)
+            int i = (x >> (bit_count * level)) & bit_mask
+            y = load(node->slots + i); level += 1
+        else
+            // slot contains another value, x not in tree
+            break
+    ctrie_read_end()
+    return found
+
+/*
+If the node at *t contains zero slots or a single value, replaces the node by
+its content and retires the node.
+*/
+void collapse_locked(uint64_t* t)
+    Node* node = (Node*)(*t & ~1) // clear LSB
+    uint64_t* slots = node->slots
+    int j = 0, n = 0
+    for int i = 0; i < slot_count; i++ do
+        if slots[i] != 0 do
+            j = i
+            n++
+            if n > 1 do return
+    if n == 0 do
+        publish(t, 0)
+        retire_locked(node)
+    else if n == 1 && is_value(slots[j]) do
+        publish(t, slots[j])
+        retire_locked(node)
+
+void remove_locked(uint64_t* t, uint64_t x, int level)
+    uint64_t y = *t
+    PLf("t = %p, y = %llx, x = %llx, level = %d", t, y, x, level)
+    if is_empty(y) do
+        // slot empty, value is not in trie, do nothing
+        return
+    else if x == y do
+        // found, remove
+        publish(t, 0)
+    else if is_node(y) do
+        // tree is a node (LSB set)
+        Node* node = (Node*)(y & ~1) // clear LSB
+        int i = (x >> (bit_count * level)) & bit_mask
+        remove_locked(node->slots + i, x, level + 1)
+        collapse_locked(t)
+    else
+        // slot contains another value, x not in tree, do nothing
+        assert("is another value", !is_empty(y) && is_value(y) && x != y)
+
+*void ctrie_remove(uint64_t* t, uint64_t x, int level)
+    require_not_null(t)
+    require("not null", x != 0)
+    require("is value", is_value(x))
+    require("not negative", level >= 0)
+    pthread_mutex_lock(&writer_lock)
+    remove_locked(t, x, level)
+    unlock()
+
+*void ctrie_print(uint64_t* t, int level, int index)
+    require_not_null(t)
+    uint64_t x = load(t)
+    if x != 0 do
+        if is_value(x) do
+            // x is a value (LSB clear)
+            printf("%d:%d: %llx\n", level, index, x)
+        else
+            // x is a node (LSB set)
+            Node* node = (Node*)(x & ~1) // clear marker bit (LSB)
+            for int i = 0; i < slot_count; i++ do
+                ctrie_print(node->slots + i, level + 1, i)
+
+*typedef bool (*CTrieVisitFn)(uint64_t x, void* context)
+
+void visit_locked(uint64_t* t, CTrieVisitFn f, void* context)
+    uint64_t x = *t
+    if x != 0 do
+        if is_value(x) do
+            // x is a value (LSB clear)
+            bool keep = f(x, context)
+            if !keep do publish(t, 0)
+        else
+            assert("valid node", is_node(x) && !is_empty(x))
+            // x is a node (LSB set)
+            Node* node = (Node*)(x & ~1) // clear marker bit (LSB)
+            for int i = 0; i < slot_count; i++ do
+                if node->slots[i] != 0 do
+                    visit_locked(node->slots + i, f, context)
+            collapse_locked(t)
+
+/*
+Calls f for each value in the trie. Removes the value if f returns false. Holds
+the writer lock while visiting. Concurrent readers are not blocked.
+*/
+*void ctrie_visit(uint64_t* t, CTrieVisitFn f, void* context)
+    require_not_null(t)
+    require_not_null(f)
+    pthread_mutex_lock(&writer_lock)
+    visit_locked(t, f, context)
+    unlock()
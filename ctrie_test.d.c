@@ -0,0 +1,309 @@
+/*
+@author: Michael Rohs
+@date: January 19, 2022
+*/
+
+// #define NO_DEBUG
+// #define NO_ASSERT
+// #define NO_REQUIRE
+// #define NO_ENSURE
+
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+#include <time.h>
+#include <pthread.h>
+#include "util.h"
+#include "ctrie.h"
+
+bool f_visit_keep(uint64_t x, void* context)
+    printf("%llx\n", x)
+    return true
+
+bool f_visit_remove(uint64_t x, void* context)
+    printf("%llx\n", x)
+    return false
+
+void test0(void)
+    uint64_t t = 0
+    ctrie_insert(&t, 0x1234, 0)
+    ctrie_print(&t, 0, 0)
+    ctrie_insert(&t, 0x1234, 0)
+    ctrie_print(&t, 0, 0)
+    test_equal_i(ctrie_contains(&t, 0x1234, 0), true)
+    test_equal_i(ctrie_contains(&t, 0x1244, 0), false)
+    ctrie_insert(&t, 0x1244, 0)
+    ctrie_print(&t, 0, 0)
+    test_equal_i(ctrie_contains(&t, 0x1234, 0), true)
+    test_equal_i(ctrie_contains(&t, 0x1244, 0), true)
+
+    ctrie_insert(&t, 0x2, 0)
+    ctrie_insert(&t, 0x6, 0)
+    ctrie_insert(&t, 0x4, 0)
+    ctrie_insert(&t, 0x44, 0)
+    ctrie_insert(&t, 0x66, 0)
+    ctrie_insert(&t, 0x88, 0)
+    ctrie_insert(&t, 0x98, 0)
+    printf("\n")
+    ctrie_print(&t, 0, 0)
+    printf("\n")
+    test_equal_i(ctrie_contains(&t, 0x1234, 0), true)
+    test_equal_i(ctrie_contains(&t, 0x1244, 0), true)
+    test_equal_i(ctrie_contains(&t, 0x2, 0), true)
+    test_equal_i(ctrie_contains(&t, 0x4, 0), true)
+    test_equal_i(ctrie_contains(&t, 0x6, 0), true)
+    test_equal_i(ctrie_contains(&t, 0x8, 0), false)
+    test_equal_i(ctrie_contains(&t, 0x88, 0), true)
+
+    ctrie_visit(&t, f_visit_keep, NULL)
+    assert("is empty", !ctrie_is_empty(&t))
+
+    ctrie_visit(&t, f_visit_remove, NULL)
+    assert("is empty", ctrie_is_empty(&t))
+
+    ctrie_reclaim()
+    test_equal_i(ctrie_retired_count(), 0)
+
+#define N 100000
+
+void test1(void)
+    uint64_t t = 0
+
+    for int i = 0; i < N; i++ do
+        uint64_t x = (i + 1) << 1
+        ctrie_insert(&t, x, 0)
+
+    for int i = 0; i < N; i++ do
+        uint64_t x = (i + 1) << 1
+        assert("", ctrie_contains(&t, x, 0))
+
+    for int i = N; i < 10 * N; i++ do
+        uint64_t x = (i + 1) << 1
+        assert("", !ctrie_contains(&t, x, 0))
+
+    for int i = 0; i < N; i++ do
+        uint64_t x = (i + 1) << 1
+        ctrie_remove(&t, x, 0)
+    assert("trie empty", t == 0)
+
+void test2(void)
+    uint64_t t = 0
+
+    for int i = 0; i < N; i++ do
+        uint64_t x = (i + 1) << 1
+        ctrie_insert(&t, x, 0)
+
+    for int i = 0; i < N; i++ do
+        uint64_t x = (i + 1) << 1
+        assert("", ctrie_contains(&t, x, 0))
+
+    for int i = N; i < 2 * N; i++ do
+        uint64_t x = (i + 1) << 1
+        assert("", !ctrie_contains(&t, x, 0))
+
+    for int i = 0; i < N/2; i++ do
+        uint64_t x = (i + 1) << 1
+        ctrie_remove(&t, x, 0)
+        ctrie_remove(&t, x, 0)
+
+    for int i = 0; i < N/2; i++ do
+        uint64_t x = (i + 1) << 1
+        assert("", !ctrie_contains(&t, x, 0))
+
+    for int i = N/2; i < N; i++ do
+        uint64_t x = (i + 1) << 1
+        assert("", ctrie_contains(&t, x, 0))
+
+    for int i = 0; i < N; i++ do
+        uint64_t x = (i + 1) << 1
+        ctrie_remove(&t, x, 0)
+    assert("trie empty", t == 0)
+
+    for int i = 0; i < N; i++ do
+        uint64_t x = (i + 1) << 1
+        ctrie_insert(&t, x, 0)
+
+    for int i = 0; i < N; i++ do
+        uint64_t x = (i + 1) << 1
+        assert("", ctrie_contains(&t, x, 0))
+
+    for int i = N; i < 10 * N; i++ do
+        uint64_t x = (i + 1) << 1
+        assert("", !ctrie_contains(&t, x, 0))
+
+    for int i = 0; i < N/2; i++ do
+        uint64_t x = (i + 1) << 1
+        ctrie_remove(&t, x, 0)
+        ctrie_remove(&t, x, 0)
+
+    for int i = 0; i < N/2; i++ do
+        uint64_t x = (i + 1) << 1
+        assert("", !ctrie_contains(&t, x, 0))
+
+    for int i = N/2; i < N; i++ do
+        uint64_t x = (i + 1) << 1
+        assert("", ctrie_contains(&t, x, 0))
+
+char* buffer[N]
+
+bool f_visit_true(uint64_t x, void* context)
+    x <<= 3
+    bool found_x = false
+    for int i = N/2; !found_x && i < N; i++ do
+        if (uint64_t)buffer[i] == x do
+            found_x = true
+    assert("found x", found_x)
+    return true
+
+bool f_visit_false(uint64_t x, void* context)
+    x <<= 3
+    bool found_x = false
+    for int i = N/2; !found_x && i < N; i++ do
+        if (uint64_t)buffer[i] == x do
+            found_x = true
+    assert("found x", found_x)
+    return false
+
+void test3(void)
+    uint64_t t = 0
+
+    assert("is empty", ctrie_is_empty(&t))
+    for int i = 0; i < N; i++ do
+        buffer[i] = xmalloc(i+1)
+        ctrie_insert(&t, (uint64_t)buffer[i] >> 3, 0)
+    assert("not is empty", !ctrie_is_empty(&t))
+
+    for int i = 0; i < N; i++ do
+        assert("", ctrie_contains(&t, (uint64_t)buffer[i] >> 3, 0))
+
+    for int i = 0; i < N/2; i++ do
+        uint64_t x = (uint64_t)buffer[i] >> 3
+        ctrie_remove(&t, x, 0)
+        ctrie_remove(&t, x, 0)
+
+    for int i = 0; i < N/2; i++ do
+        uint64_t x = (uint64_t)buffer[i] >> 3
+        assert("", !ctrie_contains(&t, x, 0))
+
+    for int i = N/2; i < N; i++ do
+        uint64_t x = (uint64_t)buffer[i] >> 3
+        assert("", ctrie_contains(&t, x, 0))
+
+    ctrie_visit(&t, f_visit_true, NULL)
+    assert("not is empty", !ctrie_is_empty(&t))
+    ctrie_visit(&t, f_visit_false, NULL)
+    assert("is empty", ctrie_is_empty(&t))
+
+    for int i = 0; i < N; i++ do
+        free(buffer[i])
+
+/*
+Stress test and benchmark: reader threads look up a stable set of values while
+a writer concurrently inserts and removes a second, interleaved set of values.
+Every stable value has to be found by every lookup.
+*/
+#define READERS 4
+#define STABLE (N / 2)
+#define ROUNDS 20
+
+uint64_t shared = 0
+bool writer_done = false
+
+// Values 2, 6, 10, ... are stable. Values 4, 8, 12, ... come and go.
+#define stable_value(i) ((uint64_t)(4 * (i) + 2))
+#define transient_value(i) ((uint64_t)(4 * (i) + 4))
+
+void* reader(void* arg)
+    uint64_t* lookups = arg
+    uint64_t n = 0
+    while !__atomic_load_n(&writer_done, __ATOMIC_ACQUIRE) do
+        for int i = 0; i < STABLE; i++ do
+            assert("stable value found", ctrie_contains(&shared, stable_value(i), 0))
+            ctrie_contains(&shared, transient_value(i), 0)
+        n += 2 * STABLE
+    *lookups = n
+    return NULL
+
+void test4(void)
+    for int i = 0; i < STABLE; i++ do
+        ctrie_insert(&shared, stable_value(i), 0)
+
+    pthread_t threads[READERS]
+    uint64_t lookups[READERS]
+    struct timespec start, end
+    clock_gettime(CLOCK_MONOTONIC, &start)
+    for int i = 0; i < READERS; i++ do
+        int err = pthread_create(threads + i, NULL, reader, lookups + i)
+        assert("thread created", err == 0)
+
+    uint64_t updates = 0
+    for int r = 0; r < ROUNDS; r++ do
+        for int i = 0; i < STABLE; i++ do
+            ctrie_insert(&shared, transient_value(i), 0)
+        for int i = 0; i < STABLE; i++ do
+            ctrie_remove(&shared, transient_value(i), 0)
+        updates += 2 * STABLE
+    __atomic_store_n(&writer_done, true, __ATOMIC_RELEASE)
+
+    uint64_t total = 0
+    for int i = 0; i < READERS; i++ do
+        pthread_join(threads[i], NULL)
+        total += lookups[i]
+    clock_gettime(CLOCK_MONOTONIC, &end)
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9
+    printf("%d readers: %.2f M lookups/s, writer: %.2f M updates/s\n",
+            READERS, total / seconds * 1e-6, updates / seconds * 1e-6)
+
+    for int i = 0; i < STABLE; i++ do
+        assert("stable value found", ctrie_contains(&shared, stable_value(i), 0))
+        assert("transient value removed", !ctrie_contains(&shared, transient_value(i), 0))
+    for int i = 0; i < STABLE; i++ do
+        ctrie_remove(&shared, stable_value(i), 0)
+    assert("is empty", ctrie_is_empty(&shared))
+    ctrie_reclaim()
+    test_equal_i(ctrie_retired_count(), 0)
+
+/*
+Short-lived reader threads: many more threads than reader slots read the trie
+one batch after another while the writer keeps updating it. Each exiting thread
+releases its slot. Every other thread releases its slot explicitly and then
+reads once more to claim a new one.
+*/
+#define SHORT_LIVED_READERS 2048
+
+void* short_lived_reader(void* arg)
+    intptr_t k = (intptr_t)arg
+    for int i = 0; i < STABLE; i += 97 do
+        assert("stable value found", ctrie_contains(&shared, stable_value(i), 0))
+    if k % 2 == 0 do
+        ctrie_release_reader()
+        assert("stable value found", ctrie_contains(&shared, stable_value(k % STABLE), 0))
+    return NULL
+
+void test5(void)
+    for int i = 0; i < STABLE; i++ do
+        ctrie_insert(&shared, stable_value(i), 0)
+
+    pthread_t threads[READERS]
+    for int k = 0; k < SHORT_LIVED_READERS; k += READERS do
+        for int i = 0; i < READERS; i++ do
+            int err = pthread_create(threads + i, NULL, short_lived_reader, (void*)(intptr_t)(k + i))
+            assert("thread created", err == 0)
+        for int i = 0; i < STABLE; i += 13 do
+            ctrie_insert(&shared, transient_value(i), 0)
+            ctrie_remove(&shared, transient_value(i), 0)
+        for int i = 0; i < READERS; i++ do
+            pthread_join(threads[i], NULL)
+
+    for int i = 0; i < STABLE; i++ do
+        ctrie_remove(&shared, stable_value(i), 0)
+    assert("is empty", ctrie_is_empty(&shared))
+    ctrie_reclaim()
+    test_equal_i(ctrie_retired_count(), 0)
+
+int main(void)
+    test0()
+    test1()
+    test2()
+    test3()
+    test4()
+    test5()
+    return 0
@@ -8,21 +8,18 @@
 // #define NO_REQUIRE
 // #define NO_ENSURE
 
+#define _GNU_SOURCE // MAP_ANONYMOUS, MADV_FREE, mincore, dl_iterate_phdr
 #include <setjmp.h>
+#ifdef __linux__
+#include <link.h>
+#endif
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "util.h"
 #include "trie.h"
 #include "gc.h"
 
-/*
-Macros for trie functions (see trie.h). The four least significant bits of
-pointers to dynamically allocated memory are zero, because such memory is
-16-byte aligned. A value in the trie must have the LSB clear. Thus the pointer
-value can be shifted right by three bits. The LSB of the result is still zero.
-*/
-#define tr_insert(t, x) trie_insert(t, (uint64_t)(x) >> 3, 0)
-#define tr_contains(t, x) trie_contains(t, (uint64_t)(x) >> 3, 0)
-#define tr_remove(t, x) trie_remove(t, (uint64_t)(x) >> 3, 0)
-
 // Gets the offset of a struct member.
 *#define offsetof(type, member) ((int)__builtin_offsetof(type, member))
 
@@ -36,20 +33,163 @@ object. The allocation header directly precedes the user object in memory.
 // Checks whether a is not NULL and 16-byte aligned.
 #define is_alloc_aligned(a) ((a) != NULL && ((uint64_t)(a) & 0xf) == 0)
 
+/*
+Macros for the trie of root objects. Root objects may be cells (see Page),
+which are only 8-byte aligned. Thus object addresses are shifted right by two
+bits. The LSB of the result is still zero.
+*/
+#define rt_insert(t, o) trie_insert(t, (uint64_t)(o) >> 2, 0)
+#define rt_contains(t, o) trie_contains(t, (uint64_t)(o) >> 2, 0)
+#define rt_remove(t, o) trie_remove(t, (uint64_t)(o) >> 2, 0)
+
+/*
+Small objects are allocated in pages ("big bag of pages"). All cells of a page
+have the same size and the same type. Cell size and type are recorded once in
+the page header, so cells do not need an allocation header. Pages are aligned
+to PAGE_SIZE, thus the page of a cell is found by clearing the low bits of its
+address. Single objects of a type and untyped objects of up to CELL_SIZE_MAX
+bytes are allocated in cells. All other objects have an allocation header (see
+Allocation).
+*/
+#define PAGE_SIZE 0x4000
+#define PAGE_SHIFT 14
+#define CELL_SIZE_MAX 256
+#define UNTYPED_CELL_SIZE_STEP 16
+#define page_address(p) ((Page*)((uint64_t)(p) & ~(uint64_t)(PAGE_SIZE - 1)))
+
+/*
+Macros for the trie of pages. The page address is shifted such that the LSB of
+the result is zero and the least significant nibble, on which the trie branches
+first, differs for adjacent pages.
+*/
+#define pg_insert(t, p) trie_insert(t, (uint64_t)(p) >> (PAGE_SHIFT - 1), 0)
+#define pg_contains(t, p) trie_contains(t, (uint64_t)(p) >> (PAGE_SHIFT - 1), 0)
+#define pg_remove(t, p) trie_remove(t, (uint64_t)(p) >> (PAGE_SHIFT - 1), 0)
+
+// Bitmaps with one bit per cell.
+#define bitmap_words(n) (((n) + 63) / 64)
+#define test_bit(bits, k) (((bits)[(k) >> 6] >> ((k) & 63)) & 1)
+#define set_bit(bits, k) (bits)[(k) >> 6] |= 1ull << ((k) & 63)
+
+// Computes the index of the cell at address o.
+#define cell_index(page, o) ((int)(((char*)(o) - (page)->cells) / (page)->cell_size))
+
+/*
+Objects of at least LARGE_SIZE_MIN bytes are large objects. Each large object
+is mapped individually and unmapped when it is swept, which returns its memory
+to the operating system. The allocation header is at the start of the mapping.
+*/
+#define LARGE_SIZE_MIN (64 * 1024)
+#define OS_PAGE_SIZE 4096
+
+/*
+Pages are carved from chunks that are mapped from the operating system. A page
+that becomes empty in a sweep is not unmapped, but becomes a dirty page: it is
+still resident and is reused first. Dirty pages that stay empty for longer than
+the decay time are purged with madvise, which returns their physical memory to
+the operating system and keeps the address range mapped. Purged pages are
+reused after the dirty pages.
+*/
+#define CHUNK_SIZE (64 * PAGE_SIZE)
+#define DIRTY_DECAY_MS_DEFAULT 1000
+
+// Lazy purging lets the operating system reclaim purged pages only under memory pressure.
+#ifdef MADV_FREE
+#define LAZY_PURGE_ADVICE MADV_FREE
+#else
+#define LAZY_PURGE_ADVICE MADV_DONTNEED
+#endif
+
 typedef struct Type Type
 typedef struct Allocation Allocation
+typedef struct Page Page
+typedef struct PageList PageList
+typedef struct LargeObject LargeObject
 
 *void gc_collect(void)
 
+/*
+Page is the header of a page of cells. The mark bits, the allocation bits, and
+the iteration state of the cells follow the header. The cells follow after that.
+Cells are allocated by bumping a pointer through the cells of the page. Freed
+cells form a list. Each freed cell stores the address of the next one in its
+first word. Dirty pages (see CHUNK_SIZE) are linked by next.
+*/
+struct Page
+    int type // type of all cells of this page (0: untyped)
+    int cell_size // byte size of each cell
+    int cell_count // number of cells of this page
+    int free_count // number of unallocated cells
+    char* free_list // first freed cell
+    char* bump // first cell that has never been allocated
+    Page* next // next page of the same page list
+    Page* next_available // next page of the same page list that has unallocated cells
+    uint64_t* marked // mark bits, one per cell
+    uint64_t* allocated // allocation bits, one per cell
+    unsigned char* js // iteration state (pointer index j), used in mark function to avoid recursion
+    char* cells // first cell
+    uint64_t empty_since // time (ms) at which the page became empty, for dirty pages only
+
+/*
+PageList holds the pages of one kind of cells. Each type has its own page list
+for single objects. Untyped cells have one page list per size class.
+*/
+struct PageList
+    int type // type of the cells (0: untyped)
+    int cell_size // byte size of the cells
+    Page* first // first page of the list
+    Page* available // first page that has unallocated cells, cells are allocated from this page
+    PageList* region // page list of the active region for these cells, NULL if none
+
+// LargeObject is an entry of the table of large objects.
+struct LargeObject
+    Allocation* a // allocation header at the start of the mapping (after an extended header)
+    uint64_t size // byte size of the mapping
+
+/*
+A trace function of a type calls gc_trace_pointer for each managed pointer of
+an object of the type, instead of interpreting the pointer offsets of the type.
+*/
+*typedef void (*GCTraceFn)(void* o)
+
+/*
+A tag scheme describes how managed pointers are encoded in tagged words, e.g.,
+by an interpreter that stores small integers or NaN-boxed doubles in the same
+fields as pointers. A word w holds a pointer if (w & tag_mask) == tag_value.
+The pointer is then (w & pointer_mask) << shift. Other words are ignored.
+*/
+typedef struct TagScheme TagScheme
+struct TagScheme
+    uint64_t tag_mask // bits that distinguish pointers from other values
+    uint64_t tag_value // value of the tag bits for pointers
+    uint64_t pointer_mask // bits that hold the (shifted) pointer
+    int shift // left shift that restores the pointer
+
+// Tag schemes. Scheme 0 is the raw pointer.
+TagScheme tag_schemes[0x100]
+int tag_schemes_count = 0
+
+// Kinds of types.
+#define TYPE_OFFSETS 0 // managed pointers at the offsets of the pointer table
+#define TYPE_POINTER_ARRAY 1 // every word is a managed pointer
+#define TYPE_BITMAP 2 // the words set in the bitmap are managed pointers
+
 /*
 Type describes an object in terms of its size and in terms of the offsets of
 pointers to managed dynamically allocated memory that the object contains. Such
 pointers may only point to the user object of an allocation and not in the
-middle of a user object.
+middle of a user object. If the type has a trace function, it is used instead
+of the pointer offsets. Pointer arrays and bitmap types also have a pointer
+table, but are traced by scanning their words.
 */
 struct Type
     int size // byte size of an object of this type
     int pointer_count // number of managed pointers that an object of this type contains
+    int kind // TYPE_OFFSETS, TYPE_POINTER_ARRAY, or TYPE_BITMAP
+    uint64_t bitmap // bit i set: i-th word is a managed pointer (TYPE_BITMAP only)
+    unsigned char* tags // tag scheme of each pointer, NULL if all pointers are raw
+    GCTraceFn trace // trace function or NULL
+    PageList pages // pages for single objects of this type
     int pointers[] // byte offsets of managed pointers
 
 /*
@@ -59,11 +199,13 @@ the user object. If type != 0 then type represents the index into the types
 array and count represents the number of instances of the type (1 for single
 objects, >=1 for arrays). If type == 0 then this allocation does not use a type
 (and hence does not contain managed pointers) and count is the byte size of the
-user object. The user object starts at offset "object".
+user object. The user object starts at offset "object". If the type index or
+the count does not fit into the header, the header holds type TYPE_EXTENDED and
+the actual values are in an extended header that directly precedes it.
 */
 struct Allocation
     int count_type_marked // 24 bits: count (byte size (for type == 0) or number of type instances)
-                          // middle 7 bits: type (at most 127 types), 1 bit (LSB): marked
+                          // middle 7 bits: type (TYPE_EXTENDED: see extended header), 1 bit (LSB): marked
     int i_j // iteration state, used in mark function to avoid recursion
            // upper 24 bits for i (element index), lower 8 bits for j (pointer index)
     char object[] // <-- user object starts here
@@ -74,20 +216,350 @@ struct Allocation
 #define get_i(a) ((a->i_j >> 8) & 0xffffff)
 #define get_j(a) (a->i_j & 0xff)
 #define set_i_j(a, i, j) a->i_j = ((i << 8) | j)
-#define get_count(a) ((a->count_type_marked >> 8) & 0xffffff)
-#define get_type(a) ((a->count_type_marked >> 1) & 0x7f)
 #define set_count_type(a, count, type) a->count_type_marked = ((count << 8) | (type << 1))
 
+typedef struct ExtendedHeader ExtendedHeader
+struct ExtendedHeader
+    int count // count of an allocation with a large count or type index
+    int type // type index
+    uint64_t reserved // keeps the allocation header 16-byte aligned
+
+#define COUNT_MAX 0xffffff
+#define TYPE_EXTENDED 0x7f
+#define extended_header(a) ((ExtendedHeader*)(a) - 1)
+#define is_extended(a) (((a->count_type_marked >> 1) & 0x7f) == TYPE_EXTENDED)
+#define needs_extended_header(count, type) ((count) > COUNT_MAX || (type) >= TYPE_EXTENDED)
+#define header_size(count, type) (sizeof(Allocation) + (needs_extended_header(count, type) ? sizeof(ExtendedHeader) : 0))
+#define get_count(a) (is_extended(a) ? extended_header(a)->count : (a->count_type_marked >> 8) & 0xffffff)
+#define get_type(a) (is_extended(a) ? extended_header(a)->type : (a->count_type_marked >> 1) & 0x7f)
+// start of the memory block of the allocation
+#define allocation_start(a) (is_extended(a) ? (void*)extended_header(a) : (void*)(a))
+
 // Pointers to type objects. Allocations store indices into the types array.
-Type* types[0x80]
+Type** types = NULL
 int types_count = 0
+int types_capacity = 0
 
-// The trie of all allocations.
-uint64_t allocations = 0
+/*
+Initializes the header of an allocation of count instances of the given type at
+p, with an extended header if needed. Returns the allocation header.
+*/
+Allocation* init_header(void* p, int count, int type)
+    Allocation* a = p
+    if needs_extended_header(count, type) do
+        ExtendedHeader* e = p
+        e->count = count
+        e->type = type
+        a = (Allocation*)(e + 1)
+        set_count_type(a, 0, TYPE_EXTENDED)
+    else
+        set_count_type(a, count, type)
+    return a
+
+/*
+The table of all allocations with header (except large objects), sorted by
+address. The allocation that contains an address is found by binary search
+(predecessor query), which makes pointers into the middle of objects
+recognizable.
+*/
+Allocation** allocations = NULL
+int allocations_table_count = 0
+int allocations_table_capacity = 0
 
-// The trie of root allocations.
+// The trie of root objects.
 uint64_t roots = 0
 
+// The trie of all pages.
+uint64_t pages = 0
+int pages_count = 0
+
+/*
+Globals of the collector that hold addresses of managed memory are placed in a
+section of their own. Scanning the data segments skips this section, otherwise
+these globals would retain objects and blacklist pages.
+*/
+#ifdef __linux__
+#define COLLECTOR_STATE __attribute__((section("gc_collector_state")))
+#else
+#define COLLECTOR_STATE
+#endif
+
+// Page lists for untyped cells, one for each size class.
+PageList untyped_pages[CELL_SIZE_MAX / UNTYPED_CELL_SIZE_STEP] COLLECTOR_STATE
+
+/*
+The table of large objects, sorted by address. Any address within a large
+object is found by binary search.
+*/
+LargeObject* large_objects = NULL
+int large_objects_count = 0
+int large_objects_capacity = 0
+
+/*
+Address bounds of all memory that has been handed out for objects. Words
+outside of these bounds are rejected by conservative scanning without a lookup.
+The fresh bounds cover the memory that has been handed out since the last
+collection (see ScanEntry).
+*/
+uint64_t heap_lo COLLECTOR_STATE = UINT64_MAX
+uint64_t heap_hi COLLECTOR_STATE = 0
+uint64_t fresh_lo COLLECTOR_STATE = UINT64_MAX
+uint64_t fresh_hi COLLECTOR_STATE = 0
+
+// Extends the heap bounds and the fresh bounds by the memory from start to end (exclusive).
+void extend_bounds(void* start, void* end)
+    if (uint64_t)start < heap_lo do heap_lo = (uint64_t)start
+    if (uint64_t)end > heap_hi do heap_hi = (uint64_t)end
+    if (uint64_t)start < fresh_lo do fresh_lo = (uint64_t)start
+    if (uint64_t)end > fresh_hi do fresh_hi = (uint64_t)end
+
+// The mapped chunks, sorted by address. Pages from chunk_next to chunk_end have never been used.
+char** chunks = NULL
+int chunks_count = 0
+char* chunk_next COLLECTOR_STATE = NULL
+char* chunk_end COLLECTOR_STATE = NULL
+
+/*
+Empty pages. Dirty pages are ordered by the time they became empty, most
+recent first. Purged pages are a stack. Its capacity is the number of pages
+of all chunks, so pushing a purged page never fails.
+*/
+Page* dirty_pages COLLECTOR_STATE = NULL
+int dirty_pages_count = 0
+Page** purged_pages = NULL
+int purged_pages_count = 0
+
+int dirty_decay_ms = DIRTY_DECAY_MS_DEFAULT
+bool lazy_purge = false
+
+// Returns the time in nanoseconds of a monotonic clock.
+uint64_t now_ns(void)
+    struct timespec ts
+    clock_gettime(CLOCK_MONOTONIC, &ts)
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec
+
+// Returns the time in milliseconds of a monotonic clock.
+uint64_t now_ms(void)
+    struct timespec ts
+    clock_gettime(CLOCK_MONOTONIC, &ts)
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000
+
+// Maps a new chunk that is aligned to PAGE_SIZE. Returns false if no memory is available.
+bool map_chunk(void)
+    uint64_t size = CHUNK_SIZE + PAGE_SIZE
+    char* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+    if p == MAP_FAILED do return false
+    // trim the mapping to an aligned chunk
+    char* chunk = (char*)page_address(p + PAGE_SIZE - 1)
+    char* end = chunk + CHUNK_SIZE
+    if chunk > p do munmap(p, chunk - p)
+    if end < p + size do munmap(end, p + size - end)
+    char** cs = realloc(chunks, (chunks_count + 1) * sizeof(char*))
+    if cs != NULL do chunks = cs
+    Page** ps = realloc(purged_pages, (chunks_count + 1) * (CHUNK_SIZE / PAGE_SIZE) * sizeof(Page*))
+    if ps != NULL do purged_pages = ps
+    if cs == NULL || ps == NULL do
+        munmap(chunk, CHUNK_SIZE)
+        return false
+    // insert into the table, keeping it sorted by address
+    int i = chunks_count++
+    while i > 0 && chunks[i - 1] > chunk do
+        chunks[i] = chunks[i - 1]
+        i--
+    chunks[i] = chunk
+    chunk_next = chunk
+    chunk_end = end
+    extend_bounds(chunk, end)
+    PLf("chunk = %p, chunks_count = %d", chunk, chunks_count)
+    return true
+
+/*
+Blacklisting (as in the Boehm collector). A word that is found by conservative
+scanning and points into a page that is not in use could become a false
+reference once the page is used. Such pages are blacklisted and not used for
+cells that contain pointers, because a false reference to such a cell would
+retain everything reachable from it. Blacklisted pages may still be used for
+pointer-free cells. Pages found in a collection are recorded in blacklist_next.
+At the start of the next collection blacklist_next replaces blacklist. Thus a
+page stays blacklisted until a collection in which it was not seen completes.
+*/
+uint64_t blacklist = 0
+uint64_t blacklist_next = 0
+bool blacklisting = true
+
+bool is_blacklisted(Page* page)
+    return blacklisting && (pg_contains(blacklist, page) || pg_contains(blacklist_next, page))
+
+// Checks whether p is within a mapped chunk.
+bool in_chunk(uint64_t p)
+    if chunks_count == 0 || p < (uint64_t)chunks[0] do return false
+    // find the last chunk that starts at or before p
+    int lo = 0, hi = chunks_count - 1
+    while lo < hi do
+        int mid = (lo + hi + 1) / 2
+        if (uint64_t)chunks[mid] <= p do lo = mid
+        else hi = mid - 1
+    return p < (uint64_t)chunks[lo] + CHUNK_SIZE
+
+/*
+Takes an unused page. A page for pointer-free cells may be blacklisted. Returns
+NULL if no memory is available.
+*/
+Page* take_page(bool pointer_free)
+    for Page** pp = &dirty_pages; *pp != NULL; pp = &(*pp)->next do
+        if pointer_free || !is_blacklisted(*pp) do
+            Page* page = *pp
+            *pp = page->next
+            dirty_pages_count--
+            return page
+    for int i = purged_pages_count - 1; i >= 0; i-- do
+        if pointer_free || !is_blacklisted(purged_pages[i]) do
+            Page* page = purged_pages[i]
+            purged_pages[i] = purged_pages[--purged_pages_count]
+            return page
+    while (true)
+        if chunk_next == chunk_end && !map_chunk() do return NULL
+        Page* page = (Page*)chunk_next
+        chunk_next += PAGE_SIZE
+        if pointer_free || !is_blacklisted(page) do return page
+        // keep the untouched page for later
+        purged_pages[purged_pages_count++] = page
+
+// Returns an empty page. The page becomes a dirty page.
+void release_page(Page* page, uint64_t now)
+    require_not_null(page)
+    page->empty_since = now
+    page->next = dirty_pages
+    dirty_pages = page
+    dirty_pages_count++
+
+// Computes the byte size of a page header, including bitmaps and iteration state, for n cells.
+int page_header_size(int n)
+    int size = sizeof(Page) + 2 * bitmap_words(n) * sizeof(uint64_t) + n
+    return (size + 15) & ~15
+
+// Returns the number of cells of the given size that fit into a page, after the page header.
+int cells_per_page(int cell_size)
+    int n = (PAGE_SIZE - sizeof(Page)) / cell_size
+    while page_header_size(n) + n * cell_size > PAGE_SIZE do n--
+    return n
+
+/*
+Makes sure that at least n dirty pages are available that are not blacklisted,
+so that they may be used for any cells. Purged and new pages are touched and
+become dirty pages, so that taking them neither maps memory nor causes page
+faults. Returns false if not enough memory could be mapped.
+*/
+bool reserve_pages(int n)
+    uint64_t now = now_ms()
+    int available = 0
+    for Page* page = dirty_pages; page != NULL && available < n; page = page->next do
+        if !is_blacklisted(page) do available++
+    int i = purged_pages_count - 1
+    while available < n do
+        Page* page = NULL
+        while i >= 0 && is_blacklisted(purged_pages[i]) do i--
+        if i >= 0 do
+            page = purged_pages[i]
+            purged_pages[i--] = purged_pages[--purged_pages_count]
+        else if chunk_next < chunk_end || map_chunk() do
+            page = (Page*)chunk_next
+            chunk_next += PAGE_SIZE
+            if is_blacklisted(page) do
+                // keep the untouched page for later
+                purged_pages[purged_pages_count++] = page
+                continue
+        else
+            return false
+        for char* p = (char*)page; p < (char*)page + PAGE_SIZE; p += OS_PAGE_SIZE do *(volatile char*)p = 0
+        release_page(page, now)
+        available++
+    return true
+
+/*
+Purges the dirty pages that have been empty for at least dirty_decay_ms. The
+dirty pages are ordered by the time they became empty, thus the pages to purge
+form the tail of the list.
+*/
+void purge_dirty_pages(uint64_t now)
+    if dirty_decay_ms < 0 do return
+    Page** pp = &dirty_pages
+    while *pp != NULL && now - (*pp)->empty_since < (uint64_t)dirty_decay_ms do pp = &(*pp)->next
+    Page* page = *pp
+    *pp = NULL
+    while page != NULL do
+        Page* next = page->next // the header is gone after purging
+        madvise(page, PAGE_SIZE, lazy_purge ? LAZY_PURGE_ADVICE : MADV_DONTNEED)
+        purged_pages[purged_pages_count++] = page
+        dirty_pages_count--
+        page = next
+    PLf("dirty_pages_count = %d, purged_pages_count = %d", dirty_pages_count, purged_pages_count)
+
+/*
+Sets the time (in milliseconds) that an empty page stays resident before it is
+purged. Empty pages are purged at the end of a collection and when this function
+is called. A decay time of 0 purges empty pages immediately, -1 never purges.
+*/
+*void gc_set_dirty_decay_ms(int ms)
+    require("valid decay time", ms >= -1)
+    dirty_decay_ms = ms
+    purge_dirty_pages(now_ms())
+
+/*
+Selects lazy purging (MADV_FREE, where available). Lazily purged pages are
+reclaimed by the operating system only under memory pressure and thus remain
+resident until then.
+*/
+*void gc_set_lazy_purge(bool lazy)
+    lazy_purge = lazy
+
+// Returns the number of bytes that the garbage collector has mapped for pages and large objects.
+*uint64_t gc_mapped_bytes(void)
+    uint64_t mapped = (uint64_t)chunks_count * CHUNK_SIZE
+    for int i = 0; i < large_objects_count; i++ do mapped += large_objects[i].size
+    return mapped
+
+// Counts the resident bytes of the mapping at p of the given byte size.
+uint64_t resident_size(void* p, uint64_t size)
+    uint64_t os_page_size = sysconf(_SC_PAGESIZE)
+    unsigned char vec[256]
+    uint64_t resident = 0
+    for uint64_t offset = 0; offset < size; offset += sizeof(vec) * os_page_size do
+        uint64_t n = size - offset
+        if n > sizeof(vec) * os_page_size do n = sizeof(vec) * os_page_size
+        if mincore((char*)p + offset, n, (void*)vec) != 0 do continue
+        for uint64_t i = 0; i < (n + os_page_size - 1) / os_page_size; i++ do
+            if vec[i] & 1 do resident += os_page_size
+    return resident
+
+// Returns the number of bytes of pages and large objects that are resident in physical memory.
+*uint64_t gc_resident_bytes(void)
+    uint64_t resident = 0
+    for int i = 0; i < chunks_count; i++ do resident += resident_size(chunks[i], CHUNK_SIZE)
+    for int i = 0; i < large_objects_count; i++ do
+        resident += resident_size(allocation_start(large_objects[i].a), large_objects[i].size)
+    return resident
+
+/*
+The log of allocations that have not been inserted into the allocations table
+yet. Inserting into the sorted table is comparatively expensive and the table
+is only queried during collection. Thus new allocations are appended to the
+log, which is merged into the table when a collection starts.
+*/
+Allocation** allocation_log = NULL
+int allocation_log_count = 0
+int allocation_log_capacity = 0
+
+/*
+Hash set of logged allocations for exact lookups between collections, e.g., in
+the assertions of gc_add_root and gc_new_handle. It is filled lazily, when a
+lookup happens, and contains the first log_indexed_count entries of the log.
+Open addressing with linear probing, at most half full.
+*/
+Allocation** log_index = NULL
+int log_index_capacity = 0 // power of 2
+int log_indexed_count = 0
+
 // Allocation statistics. Used to decide when to trigger a collection before an allocation.
 uint64_t allocations_count = 0
 uint64_t allocations_size = 0
@@ -97,18 +569,253 @@ uint64_t count_threshold = COUNT_THRESHOLD_MIN
 uint64_t size_threshold = SIZE_THRESHOLD_MIN
 uint64_t collections_count = 0
 
+/*
+Pacing. After a collection, the thresholds are set to the live count and size
+plus growth_percent percent (at least the minimums). Native memory that is owned
+by managed objects is accounted as external bytes and counts toward the heap
+size. The live size is the number of allocated bytes after a collection, without
+external bytes. A soft limit lowers the size threshold to the limit, but leaves
+at least 1/16 of the live size as headroom, so that a heap above the limit is not
+collected on every allocation. With a collection interval, a collection is also
+triggered if the interval has passed since the last collection and at least
+1/16 of the live size has been allocated since then, i.e., the allocation rate
+is high enough to be worth it. The clock is only read every 4096 allocations.
+*/
+int growth_percent = 100
+uint64_t soft_limit = 0 // 0: no limit
+int64_t external_bytes = 0
+int collection_interval_ms = 0 // 0: no time trigger
+uint64_t last_collection_ms = 0
+uint64_t live_size = 0 // allocations_size after the last collection
+uint64_t allocations_since_check = 0
+#define INTERVAL_CHECK_MASK 0xfff
+
+// Returns the size of the heap, including external bytes.
+uint64_t heap_size(void)
+    return allocations_size + external_bytes
+
+// Sets the growth of the heap until the next collection in percent of the live heap. The default is 100.
+*void gc_set_growth_percent(int percent)
+    require("positive", percent > 0)
+    growth_percent = percent
+
+// Sets a soft limit of the heap size in bytes, including external bytes. 0 means no limit.
+*void gc_set_soft_limit(uint64_t bytes)
+    soft_limit = bytes
+
+/*
+Sets the maximum time between collections while the program allocates. 0
+means no time trigger (the default).
+*/
+*void gc_set_collection_interval_ms(int ms)
+    require("not negative", ms >= 0)
+    collection_interval_ms = ms
+
+/*
+Memory pressure. In a container, the memory limit of the cgroup (v2) is usually
+reached long before calloc fails, and then the OOM killer ends the process. The
+collector reads memory.max, memory.current, and memory.pressure of the cgroup
+after each collection and every 64K allocations. The heap may grow by at most
+half of the remaining headroom (a quarter under memory pressure, i.e., if
+processes stalled for memory in more than 10 % of the last 10 s). Far below the
+limit (less than a quarter used, no pressure) the growth is doubled, which
+saves collections. The cgroup directory is found in /proc/self/cgroup and may
+be set with gc_set_cgroup_path. Without a cgroup limit, nothing changes.
+*/
+char cgroup_path[256] = ""
+int cgroup_state = 0 // 0: not initialized, 1: enabled, -1: disabled
+uint64_t live_heap = 0 // heap_size() after the last collection
+#define CGROUP_CHECK_MASK 0xffff
+#define PRESSURE_HIGH 10.0 // percent of time stalled
+#define PRESSURE_LOW 1.0
+
+/*
+Sets the directory of the cgroup files memory.max, memory.current, and
+memory.pressure. NULL disables memory-pressure-aware triggering.
+*/
+*void gc_set_cgroup_path(char* path)
+    if path == NULL do
+        cgroup_state = -1
+        return
+    require("valid length", strlen(path) < sizeof(cgroup_path))
+    strcpy(cgroup_path, path)
+    cgroup_state = 1
+
+// Finds the cgroup v2 directory of the process.
+void init_cgroup_path(void)
+    cgroup_state = -1
+    FILE* f = fopen("/proc/self/cgroup", "r")
+    if f == NULL do return
+    char line[256]
+    while fgets(line, sizeof(line), f) != NULL do
+        if strncmp(line, "0::", 3) == 0 do // the unified (v2) hierarchy
+            line[strcspn(line, "\n")] = '\0'
+            snprintf(cgroup_path, sizeof(cgroup_path), "/sys/fs/cgroup%s", line + 3)
+            cgroup_state = 1
+            break
+    fclose(f)
+
+// Reads a cgroup file into buf. Returns false if it cannot be read.
+bool read_cgroup_file(char* name, char* buf, int size)
+    char path[320]
+    snprintf(path, sizeof(path), "%s/%s", cgroup_path, name)
+    FILE* f = fopen(path, "r")
+    if f == NULL do return false
+    int n = fread(buf, 1, size - 1, f)
+    fclose(f)
+    buf[n] = '\0'
+    return n > 0
+
+/*
+Reads the memory limit, the memory usage, and the share of time stalled for
+memory in the last 10 s (in percent) of the cgroup. Returns false if there is
+no limit.
+*/
+bool read_cgroup_memory(uint64_t* max, uint64_t* current, double* pressure)
+    if cgroup_state == 0 do init_cgroup_path()
+    if cgroup_state < 0 do return false
+    char buf[256]
+    if !read_cgroup_file("memory.max", buf, sizeof(buf)) || strncmp(buf, "max", 3) == 0 do return false
+    *max = strtoull(buf, NULL, 10)
+    if !read_cgroup_file("memory.current", buf, sizeof(buf)) do return false
+    *current = strtoull(buf, NULL, 10)
+    *pressure = 0
+    if read_cgroup_file("memory.pressure", buf, sizeof(buf)) do sscanf(buf, "some avg10=%lf", pressure)
+    return *max > 0
+
+// Returns the size threshold for the heap of the given live size that the cgroup allows.
+uint64_t cgroup_threshold(uint64_t live, uint64_t max, uint64_t current, double pressure)
+    uint64_t headroom = max > current ? max - current : 0
+    uint64_t growth = pressure >= PRESSURE_HIGH ? headroom / 4 : headroom / 2
+    if growth < live / 16 do growth = live / 16
+    return live + growth
+
+// Lowers the size threshold if the cgroup's memory usage has grown since the last collection.
+void check_cgroup_memory(void)
+    uint64_t max, current
+    double pressure
+    if !read_cgroup_memory(&max, &current, &pressure) do return
+    uint64_t threshold = cgroup_threshold(live_heap, max, current, pressure)
+    if size_threshold > threshold do size_threshold = threshold
+
+/*
+No-GC regions. Within a region, allocations do not trigger collections (unless
+memory is exhausted). On entry, the collector collects if the budget of the
+region would exceed the size threshold and reserves resident pages, which are
+not blacklisted, for cells of the budget. This bounds the latency of allocations
+of cells. Objects with header are allocated with calloc and large objects are
+mapped individually.
+*/
+bool no_gc_region = false
+uint64_t region_budget = 0
+uint64_t no_gc_allocated = 0 // bytes allocated since the no-GC region began
+
+/*
+Returns the number of pages that cells of the given number of bytes need in the
+worst case. The cells of a page of the least favorable cell size use only
+usable bytes of the page. In addition, each page list that is allocated from may
+end with a partially used page. The page lists of regions (see gc_region_begin)
+and of types that are created later are not accounted.
+*/
+int budget_pages(uint64_t bytes)
+    uint64_t usable = PAGE_SIZE
+    for int c = 8; c <= CELL_SIZE_MAX; c += 8 do
+        uint64_t u = (uint64_t)cells_per_page(c) * c
+        if u < usable do usable = u
+    uint64_t lists = CELL_SIZE_MAX / UNTYPED_CELL_SIZE_STEP + types_count
+    uint64_t min_cells = (bytes + 7) / 8 // at most this many page lists are used
+    if lists > min_cells do lists = min_cells
+    return (bytes + usable - 1) / usable + lists
+
+/*
+Begins a no-GC region in which at most bytes bytes are going to be allocated.
+Returns false if the memory for the region could not be reserved.
+*/
+*bool gc_begin_no_gc_region(uint64_t bytes)
+    require("not in a no-GC region", !no_gc_region)
+    if heap_size() + bytes >= size_threshold || allocations_count >= count_threshold do gc_collect()
+    bool reserved = reserve_pages(budget_pages(bytes))
+    no_gc_region = true
+    region_budget = bytes
+    no_gc_allocated = 0
+    return reserved
+
+// Ends a no-GC region. Returns false if more than the budget has been allocated in the region.
+*bool gc_end_no_gc_region(void)
+    require("in a no-GC region", no_gc_region)
+    no_gc_region = false
+    return no_gc_allocated <= region_budget
+
+// Checks whether a collection is due before the next allocation.
+bool collection_due(void)
+    if no_gc_region do return false
+    if allocations_count >= count_threshold || heap_size() >= size_threshold do return true
+    if (++allocations_since_check & INTERVAL_CHECK_MASK) == 0 do
+        bool allocated_enough = allocations_size - live_size >= live_size / 16
+        if collection_interval_ms > 0 && allocated_enough && now_ms() - last_collection_ms >= (uint64_t)collection_interval_ms do
+            return true
+        if (allocations_since_check & CGROUP_CHECK_MASK) == 0 && cgroup_state >= 0 do
+            check_cgroup_memory()
+            return heap_size() >= size_threshold
+    return false
+
+// Sets the thresholds for the next collection after a collection.
+void set_thresholds(void)
+    uint64_t live = heap_size()
+    count_threshold = allocations_count + allocations_count * growth_percent / 100
+    if count_threshold < COUNT_THRESHOLD_MIN do count_threshold = COUNT_THRESHOLD_MIN
+    size_threshold = live + live * growth_percent / 100
+    if size_threshold < SIZE_THRESHOLD_MIN do size_threshold = SIZE_THRESHOLD_MIN
+    uint64_t max, current
+    double pressure
+    if read_cgroup_memory(&max, &current, &pressure) do
+        if current < max / 4 && pressure < PRESSURE_LOW do
+            size_threshold += live * growth_percent / 100 // far below the limit
+        uint64_t threshold = cgroup_threshold(live, max, current, pressure)
+        if size_threshold > threshold do size_threshold = threshold
+    live_size = allocations_size
+    if soft_limit > 0 && size_threshold > soft_limit do
+        size_threshold = soft_limit
+        if size_threshold < live + live_size / 16 do size_threshold = live + live_size / 16
+    live_heap = live
+    if collection_interval_ms > 0 do last_collection_ms = now_ms()
+
 // Returns the number of bytes of the user part of the allocation.
-int allocation_size(Allocation* a)
+uint64_t allocation_size(Allocation* a)
     require_not_null(a)
     int type_index = get_type(a)
     if type_index == 0 do return get_count(a)
     Type* type = types[type_index]
-    return type->size * get_count(a)
+    return (uint64_t)type->size * get_count(a)
+
+// Returns the number of bytes of the objects that are currently allocated.
+*uint64_t gc_allocated_bytes(void)
+    return allocations_size
+
+// Returns the number of collections so far.
+*uint64_t gc_collections_count(void)
+    return collections_count
+
+// Returns the heap size (including external bytes) at which the next collection is triggered.
+*uint64_t gc_size_threshold(void)
+    return size_threshold
+
+/*
+Accounts for native memory that is owned by managed objects, e.g., buffers that
+are released by finalizers. delta is positive when native memory is allocated
+and negative when it is released. May trigger a collection.
+*/
+*void gc_add_external_bytes(int64_t delta)
+    require("not negative", external_bytes + delta >= 0)
+    external_bytes += delta
+    if delta > 0 && !no_gc_region && heap_size() >= size_threshold do gc_collect()
 
 // Prints statistics about the garbage collector.
 *void gc_print_stats(void)
-    printf("allocations = %llu, bytes = %llu, count_threshold = %llu, size_threshold = %llu, collections = %llu\n",
-            allocations_count, allocations_size, count_threshold, size_threshold, collections_count)
+    printf("allocations = %llu, bytes = %llu, pages = %d, large objects = %d, count_threshold = %llu, size_threshold = %llu, collections = %llu\n",
+            allocations_count, allocations_size, pages_count, large_objects_count, count_threshold, size_threshold, collections_count)
+    printf("mapped = %llu, resident = %llu, dirty pages = %d, purged pages = %d, external = %lld\n",
+            gc_mapped_bytes(), gc_resident_bytes(), dirty_pages_count, purged_pages_count, external_bytes)
 
 /*
 The bottom of the call stack is set in the initialization (or main) function.
@@ -125,32 +832,559 @@ gc_set_bottom_of_stack(__builtin_frame_address(0))
     require("aligned pointer", ((uint64_t)bos & 7) == 0)
     bottom_of_stack = bos
 
+/*
+Stacks of coroutines and user-level threads. Each registered stack has a handle
+(an index into the table of stacks). The main stack has handle GC_MAIN_STACK.
+Exactly one stack is running, the others are suspended. When a stack is
+suspended, its stack pointer and optionally a saved register context (e.g., a
+jmp_buf or ucontext_t) are recorded. A suspended stack is scanned only in its
+used region, from the saved stack pointer to its high end, and its register
+context is scanned. The running stack is scanned from the current frame to its
+high end. Registering and unregistering stacks takes constant time, unused
+entries form a free list.
+*/
+*#define GC_MAIN_STACK 0
+*typedef int gc_stack_t
+
+typedef struct Stack Stack
+struct Stack
+    char* lo // low end of the stack memory
+    char* hi // high end of the stack memory (exclusive), the stack grows down from here
+    char* sp // saved stack pointer (suspended stacks only)
+    char* context // saved register context (suspended stacks only, may be NULL)
+    int context_size // byte size of the saved register context
+    int state // STACK_FREE, STACK_RUNNING, or STACK_SUSPENDED
+    int next_free // next unused entry, 0 if none (STACK_FREE only)
+
+#define STACK_FREE 0
+#define STACK_RUNNING 1
+#define STACK_SUSPENDED 2
+
+Stack* stacks = NULL
+int stacks_count = 0 // number of used entries of the table, including free ones
+int stacks_capacity = 0
+int stacks_free = 0 // first unused entry, 0 if none
+int suspended_stacks_count = 0
+gc_stack_t current_stack = GC_MAIN_STACK
+
+// Makes sure that the main stack has an entry.
+void init_stacks(void)
+    if stacks_count > 0 do return
+    stacks_capacity = 16
+    stacks = xcalloc(stacks_capacity, sizeof(Stack))
+    stacks[GC_MAIN_STACK].state = STACK_RUNNING
+    stacks_count = 1
+
+/*
+Registers the memory of a stack from lo (inclusive) to hi (exclusive). The new
+stack is suspended and empty. Returns the handle of the stack.
+*/
+*gc_stack_t gc_register_stack(void* lo, void* hi)
+    require("valid stack", lo != NULL && (char*)lo < (char*)hi)
+    init_stacks()
+    int h = stacks_free
+    if h != 0 do
+        stacks_free = stacks[h].next_free
+    else
+        if stacks_count >= stacks_capacity do
+            int capacity = 2 * stacks_capacity
+            Stack* table = realloc(stacks, capacity * sizeof(Stack))
+            if table == NULL do panic("Cannot allocate memory.")
+            stacks = table
+            stacks_capacity = capacity
+        h = stacks_count++
+    stacks[h] = (Stack){lo, hi, hi, NULL, 0, STACK_SUSPENDED, 0}
+    suspended_stacks_count++
+    return h
+
+// Unregisters a suspended stack. Its memory is no longer scanned.
+*void gc_unregister_stack(gc_stack_t h)
+    require("valid stack", 0 < h && h < stacks_count && stacks[h].state == STACK_SUSPENDED)
+    stacks[h].state = STACK_FREE
+    stacks[h].next_free = stacks_free
+    stacks_free = h
+    suspended_stacks_count--
+
+/*
+Records that the running stack h is suspended, e.g. before switching to another
+coroutine. sp is the stack pointer at the switch (any address in the frame of the
+switching function). The saved register context of context_size bytes is also
+scanned. context may be NULL.
+*/
+*void gc_suspend_stack(gc_stack_t h, void* sp, void* context, int context_size)
+    init_stacks()
+    require("valid stack", 0 <= h && h < stacks_count && h == current_stack)
+    require("valid context", context_size >= 0 && (context != NULL || context_size == 0))
+    Stack* s = stacks + h
+    if h == GC_MAIN_STACK do s->hi = (char*)bottom_of_stack
+    require("sp in stack", (h == GC_MAIN_STACK || s->lo <= (char*)sp) && (char*)sp <= s->hi)
+    s->sp = sp
+    s->context = context
+    s->context_size = context_size
+    s->state = STACK_SUSPENDED
+    suspended_stacks_count++
+    current_stack = -1
+
+// Records that the suspended stack h is running, e.g. after switching to it.
+*void gc_resume_stack(gc_stack_t h)
+    init_stacks()
+    require("valid stack", 0 <= h && h < stacks_count && stacks[h].state == STACK_SUSPENDED)
+    require("no running stack", current_stack < 0)
+    stacks[h].state = STACK_RUNNING
+    suspended_stacks_count--
+    current_stack = h
+
+/*
+Precise stack roots. In precise mode the stack is not scanned conservatively.
+Instead, client code registers the addresses of its local managed pointers in a
+shadow stack and only these slots are scanned. GC_FRAME opens a frame in the
+current scope, which is popped when the scope is left. GC_LOCAL(x) registers the
+local pointer variable x in the current frame. At most one GC_FRAME per scope.
+Example:
+    Node* t = NULL
+    GC_FRAME; GC_LOCAL(t)
+*/
+*#define GC_FRAME int gc_frame_ __attribute__((cleanup(gc_pop_frame))) = gc_push_frame()
+*#define GC_LOCAL(x) gc_push_local((void**)&(x))
+
+// The shadow stack of addresses of local managed pointers.
+void*** shadow_stack = NULL
+int shadow_stack_count = 0
+int shadow_stack_capacity = 0
+bool precise_stack = false
+
+// Opens a frame of the shadow stack. Returns the depth to restore when the frame is popped. Use GC_FRAME.
+*int gc_push_frame(void)
+    return shadow_stack_count
+
+// Pops the frame that has been opened at the given depth. Use GC_FRAME.
+*void gc_pop_frame(int* depth)
+    require_not_null(depth)
+    require("valid depth", 0 <= *depth && *depth <= shadow_stack_count)
+    shadow_stack_count = *depth
+
+// Registers the address of a local managed pointer in the current frame. Use GC_LOCAL.
+*void gc_push_local(void** slot)
+    require_not_null(slot)
+    if shadow_stack_count >= shadow_stack_capacity do
+        int capacity = shadow_stack_capacity == 0 ? 256 : 2 * shadow_stack_capacity
+        void*** stack = realloc(shadow_stack, capacity * sizeof(void**))
+        if stack == NULL do panic("Cannot allocate memory.")
+        shadow_stack = stack
+        shadow_stack_capacity = capacity
+    shadow_stack[shadow_stack_count++] = slot
+
+/*
+Selects precise mode. In precise mode only the pointers that are registered in
+the shadow stack (and the root objects) are roots, registers and the stack are
+not scanned.
+*/
+*void gc_set_precise_stack(bool precise)
+    precise_stack = precise
+
+// Appends a new allocation to the allocation log.
+void log_allocation(Allocation* a)
+    require("is aligned", is_alloc_aligned(a))
+    if allocation_log_count >= allocation_log_capacity do
+        int capacity = allocation_log_capacity == 0 ? 1024 : 2 * allocation_log_capacity
+        Allocation** log = realloc(allocation_log, capacity * sizeof(Allocation*))
+        if log == NULL && allocation_log_count > 0 do
+            // if could not get memory, collect (which empties the log)
+            gc_collect()
+        else
+            if log == NULL do panic("Cannot allocate memory.") // the log has no room at all
+            allocation_log = log
+            allocation_log_capacity = capacity
+    assert("log not full", allocation_log_count < allocation_log_capacity)
+    allocation_log[allocation_log_count++] = a
+
+uint64_t log_hash(Allocation* a)
+    return ((uint64_t)a * 0x9e3779b97f4a7c15ull) >> 32
+
+void log_index_insert(Allocation* a)
+    uint64_t mask = log_index_capacity - 1
+    uint64_t i = log_hash(a) & mask
+    while log_index[i] != NULL do i = (i + 1) & mask
+    log_index[i] = a
+
+/*
+Adds the logged allocations that are not in the index yet. Returns false if the
+index could not be allocated.
+*/
+bool update_log_index(void)
+    if 2 * allocation_log_count > log_index_capacity do
+        int capacity = log_index_capacity == 0 ? 1024 : log_index_capacity
+        while capacity < 2 * allocation_log_count do capacity *= 2
+        Allocation** index = calloc(capacity, sizeof(Allocation*))
+        if index == NULL do return false
+        free(log_index)
+        log_index = index
+        log_index_capacity = capacity
+        log_indexed_count = 0
+    while log_indexed_count < allocation_log_count do
+        log_index_insert(allocation_log[log_indexed_count++])
+    return true
+
+// Empties the index. Called when the log is flushed.
+void clear_log_index(void)
+    if log_indexed_count == 0 do return
+    memset(log_index, 0, log_index_capacity * sizeof(Allocation*))
+    log_indexed_count = 0
+
+// Checks whether a is in the allocation log. Amortized constant time.
+bool log_contains(Allocation* a)
+    if allocation_log_count == 0 do return false
+    if !update_log_index() do
+        // no memory for the index, search linearly
+        for int i = 0; i < allocation_log_count; i++ do
+            if allocation_log[i] == a do return true
+        return false
+    uint64_t mask = log_index_capacity - 1
+    for uint64_t i = log_hash(a) & mask; log_index[i] != NULL; i = (i + 1) & mask do
+        if log_index[i] == a do return true
+    return false
+
+/*
+Returns the index of the allocation in the allocations table that contains p
+(from the start of its header to the end of its user object) or -1 if there is
+none.
+*/
+int allocation_index(uint64_t p)
+    if allocations_table_count == 0 do return -1
+    if p < (uint64_t)allocations[0] do return -1
+    // find the last allocation that starts at or before p
+    int lo = 0, hi = allocations_table_count - 1
+    while lo < hi do
+        int mid = (lo + hi + 1) / 2
+        if (uint64_t)allocations[mid] <= p do lo = mid
+        else hi = mid - 1
+    Allocation* a = allocations[lo]
+    if p < (uint64_t)a->object + allocation_size(a) do return lo
+    return -1
+
+// Checks whether a is an allocation, either in the table or in the log.
+bool is_allocation(Allocation* a)
+    if !is_alloc_aligned(a) do return false
+    int i = allocation_index((uint64_t)a)
+    return (i >= 0 && allocations[i] == a) || log_contains(a)
+
+int compare_addresses(const void* p, const void* q)
+    uint64_t x = *(uint64_t*)p
+    uint64_t y = *(uint64_t*)q
+    return (x > y) - (x < y)
+
+/*
+Sorts addresses in ascending order. Uses an LSD radix sort on bytes. Bytes that
+are equal for all values (such as the high bytes of addresses) are skipped.
+*/
+void sort_addresses(uint64_t* values, int n)
+    require("not negative", n >= 0)
+    if n < 2 do return
+    uint64_t* tmp = malloc(n * sizeof(uint64_t))
+    if tmp == NULL do
+        qsort(values, n, sizeof(uint64_t), compare_addresses)
+        return
+    uint64_t* src = values
+    uint64_t* dst = tmp
+    int counts[256]
+    for int shift = 0; shift < 64; shift += 8 do
+        memset(counts, 0, sizeof(counts))
+        for int i = 0; i < n; i++ do counts[(src[i] >> shift) & 0xff]++
+        if counts[(src[0] >> shift) & 0xff] == n do continue // all equal
+        int offset = 0
+        for int d = 0; d < 256; d++ do
+            int count = counts[d]
+            counts[d] = offset
+            offset += count
+        for int i = 0; i < n; i++ do dst[counts[(src[i] >> shift) & 0xff]++] = src[i]
+        uint64_t* t = src; src = dst; dst = t
+    if src != values do memcpy(values, src, n * sizeof(uint64_t))
+    free(tmp)
+    ensure("sorted", forall(i, n - 1, values[i] <= values[i + 1]))
+
+/*
+Merges the logged allocations into the allocations table. The log is sorted
+first. Then both are merged from the end, in place.
+*/
+void flush_allocation_log(void)
+    PLf("allocation_log_count = %d", allocation_log_count)
+    int n = allocation_log_count
+    if n == 0 do return
+    int count = allocations_table_count + n
+    if count > allocations_table_capacity do
+        int capacity = allocations_table_capacity == 0 ? 1024 : allocations_table_capacity
+        while capacity < count do capacity *= 2
+        Allocation** table = realloc(allocations, capacity * sizeof(Allocation*))
+        if table == NULL do panic("Cannot allocate memory.")
+        allocations = table
+        allocations_table_capacity = capacity
+    sort_addresses((uint64_t*)allocation_log, n)
+    int i = allocations_table_count - 1, j = n - 1, k = count - 1
+    while j >= 0 do
+        if i >= 0 && (uint64_t)allocations[i] > (uint64_t)allocation_log[j] do
+            allocations[k--] = allocations[i--]
+        else
+            allocations[k--] = allocation_log[j--]
+    allocations_table_count = count
+    allocation_log_count = 0
+    clear_log_index()
+    ensure("sorted", forall(i, count - 1, (uint64_t)allocations[i] < (uint64_t)allocations[i + 1]))
+
+// Returns the page that contains p or NULL if p is not in a page.
+Page* page_of(void* p)
+    Page* page = page_address(p)
+    if page != NULL && pg_contains(pages, page) do return page
+    return NULL
+
+// Checks whether p is the address of an allocated cell of the page.
+bool is_allocated_cell(Page* page, char* p)
+    require_not_null(page)
+    if p < page->cells do return false
+    int k = cell_index(page, p)
+    return k < page->cell_count && page->cells + k * page->cell_size == p && test_bit(page->allocated, k)
+
+/*
+Returns the index of the large object that contains p (from the start of its
+allocation header to the end of its user object) or -1 if there is none.
+*/
+int large_object_index(uint64_t p)
+    if large_objects_count == 0 do return -1
+    if p < (uint64_t)large_objects[0].a do return -1
+    // find the last large object that starts at or before p
+    int lo = 0, hi = large_objects_count - 1
+    while lo < hi do
+        int mid = (lo + hi + 1) / 2
+        if (uint64_t)large_objects[mid].a <= p do lo = mid
+        else hi = mid - 1
+    Allocation* a = large_objects[lo].a
+    if p < (uint64_t)a->object + allocation_size(a) do return lo
+    return -1
+
+// Checks whether o is the user object of a large object.
+bool is_large_object(void* o)
+    int i = large_object_index((uint64_t)o)
+    return i >= 0 && large_objects[i].a->object == o
+
+// Checks whether o is the user object of an allocation or an allocated cell.
+bool is_object(void* o)
+    Page* page = page_of(o)
+    if page != NULL do return is_allocated_cell(page, o)
+    return is_large_object(o) || is_allocation(allocation_address(o))
+
+/*
+Allocates a new page for the given page list. The page header is initialized
+and all cells are unallocated. The cells are zeroed when they are allocated.
+*/
+Page* new_page(PageList* list)
+    require_not_null(list)
+    require("valid cell size", 0 < list->cell_size && list->cell_size <= CELL_SIZE_MAX)
+    bool pointer_free = list->type == 0 || types[list->type]->pointer_count == 0
+    Page* page = take_page(pointer_free)
+    if page == NULL do
+        // if could not get memory, collect and try again
+        gc_collect()
+        page = take_page(pointer_free)
+        if page == NULL do panic("Cannot allocate memory.")
+    int cell_size = list->cell_size
+    int n = cells_per_page(cell_size)
+    int words = bitmap_words(n)
+    page->type = list->type
+    page->cell_size = cell_size
+    page->cell_count = n
+    page->free_count = n
+    page->marked = (uint64_t*)(page + 1)
+    page->allocated = page->marked + words
+    page->js = (unsigned char*)(page->allocated + words)
+    page->cells = (char*)page + page_header_size(n)
+    memset(page->marked, 0, 2 * words * sizeof(uint64_t))
+    page->free_list = NULL
+    page->bump = page->cells
+    page->next = list->first
+    list->first = page
+    page->next_available = list->available
+    list->available = page
+    pg_insert(&pages, page)
+    pages_count++
+    PLf("page = %p, type = %d, cell_size = %d, cell_count = %d", page, page->type, cell_size, n)
+    ensure("cells fit", page->cells + n * cell_size <= (char*)page + PAGE_SIZE)
+    return page
+
+// Allocates a zeroed cell from the pages of the given page list.
+void* alloc_cell(PageList* list)
+    require_not_null(list)
+    Page* page = list->available
+    if page == NULL do page = new_page(list)
+    assert("has unallocated cells", page == list->available && page->free_count > 0)
+    char* cell = page->free_list
+    if cell != NULL do
+        page->free_list = *(char**)cell
+    else
+        cell = page->bump
+        page->bump += page->cell_size
+    page->free_count--
+    if page->free_count == 0 do list->available = page->next_available
+    set_bit(page->allocated, cell_index(page, cell))
+    memset(cell, 0, page->cell_size)
+    extend_bounds(cell, cell + page->cell_size)
+    ensure("is cell", is_allocated_cell(page, cell))
+    return cell
+
+// Returns the page list for untyped cells of the given byte size.
+PageList* untyped_page_list(int size)
+    require("valid size", 0 < size && size <= CELL_SIZE_MAX)
+    int c = (size - 1) / UNTYPED_CELL_SIZE_STEP
+    PageList* list = untyped_pages + c
+    if list->cell_size == 0 do list->cell_size = (c + 1) * UNTYPED_CELL_SIZE_STEP
+    return list
+
+/*
+Regions. Computations often build a temporary object graph that becomes garbage
+as a whole. Cells that are allocated between gc_region_begin and gc_region_end
+are bump-allocated from pages of the region, which hold no other cells. These
+pages are ordinary pages otherwise, so region objects are marked precisely if
+referenced. After gc_region_end, no more cells are allocated from the pages of
+the region. gc_region_end does not check whether objects escaped, as that needs
+a full mark, so the pages of a closed region are not reused before the next
+collection. The next collection checks the mark bitmap of each page of the
+region. If no cell is marked, the pages are released without sweeping their
+cells. The cost is linear in the number of pages of the region, but not in the
+number of cells. Otherwise, an object has escaped and the pages are returned to
+their page lists and swept as usual. Only cells are allocated from region
+pages. Objects with header and large objects are allocated and swept as usual
+in a region. Regions do not nest.
+*/
+bool region_active = false
+PageList** region_owners = NULL // page lists that have a page list of the active region
+int region_owners_count = 0
+int region_owners_capacity = 0
+Page** closed_regions = NULL // first page of each closed region, pages linked by next
+int closed_regions_count = 0
+int closed_regions_capacity = 0
+
+// Begins a region. Cells are allocated from pages of the region until gc_region_end is called.
+*void gc_region_begin(void)
+    require("no active region", !region_active)
+    region_active = true
+
+// Returns the page list of the active region for cells of the given page list.
+PageList* region_page_list(PageList* list)
+    if list->region == NULL do
+        PageList* r = xcalloc(1, sizeof(PageList))
+        r->type = list->type
+        r->cell_size = list->cell_size
+        list->region = r
+        if region_owners_count >= region_owners_capacity do
+            int capacity = region_owners_capacity == 0 ? 64 : 2 * region_owners_capacity
+            PageList** owners = realloc(region_owners, capacity * sizeof(PageList*))
+            if owners == NULL do panic("Cannot allocate memory.")
+            region_owners = owners
+            region_owners_capacity = capacity
+        region_owners[region_owners_count++] = list
+    return list->region
+
+/*
+Ends the active region. Its pages are held until the next collection, which
+releases them if none of its cells is reachable.
+*/
+*void gc_region_end(void)
+    require("active region", region_active)
+    region_active = false
+    Page* first = NULL
+    for int i = 0; i < region_owners_count; i++ do
+        PageList* r = region_owners[i]->region
+        Page* page = r->first
+        while page != NULL do
+            Page* next = page->next
+            page->next = first
+            first = page
+            page = next
+        free(r)
+        region_owners[i]->region = NULL
+    region_owners_count = 0
+    if first == NULL do return
+    if closed_regions_count >= closed_regions_capacity do
+        int capacity = closed_regions_capacity == 0 ? 16 : 2 * closed_regions_capacity
+        Page** regions = realloc(closed_regions, capacity * sizeof(Page*))
+        if regions == NULL do panic("Cannot allocate memory.")
+        closed_regions = regions
+        closed_regions_capacity = capacity
+    closed_regions[closed_regions_count++] = first
+
+/*
+Maps a large object of count instances of the given type (count bytes for type
+0) with a user object of the given byte size. Mapped memory is zeroed.
+*/
+void* alloc_large(int type, int count, uint64_t size)
+    require("is large", size >= LARGE_SIZE_MIN)
+    uint64_t map_size = (header_size(count, type) + size + OS_PAGE_SIZE - 1) & ~(uint64_t)(OS_PAGE_SIZE - 1)
+    void* p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+    if p == MAP_FAILED do
+        // if could not get memory, collect and try again
+        gc_collect()
+        p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+        if p == MAP_FAILED do panic("Cannot allocate memory.")
+    Allocation* a = init_header(p, count, type)
+    if large_objects_count >= large_objects_capacity do
+        int capacity = large_objects_capacity == 0 ? 64 : 2 * large_objects_capacity
+        LargeObject* table = realloc(large_objects, capacity * sizeof(LargeObject))
+        if table == NULL do panic("Cannot allocate memory.")
+        large_objects = table
+        large_objects_capacity = capacity
+    // insert into the table, keeping it sorted by address
+    int i = large_objects_count
+    while i > 0 && (uint64_t)large_objects[i - 1].a > (uint64_t)a do
+        large_objects[i] = large_objects[i - 1]
+        i--
+    large_objects[i] = (LargeObject){a, map_size}
+    extend_bounds(p, (char*)p + map_size)
+    large_objects_count++
+    PLf("a = %p, o = %p, map_size = %llu", a, a->object, map_size)
+    ensure("is large object", is_large_object(a->object))
+    return a->object
+
 // Allocates count objects of the given type.
 void* alloc(int type, int count)
     require("valid range", 0 <= type && type <= types_count)
-    require("valid range", 0 < count && count <= 0xffffff)
-    if allocations_count >= count_threshold || allocations_size >= size_threshold do
+    require("valid range", 0 < count)
+    if collection_due() do
         gc_collect()
-    int size = count
+    uint64_t size = count
     if type > 0 do size *= types[type]->size
-    Allocation* a = calloc(1, sizeof(Allocation) + size)
-    if a == NULL do
+    if (type == 0 || count == 1) && size <= CELL_SIZE_MAX do
+        PageList* list = (type == 0) ? untyped_page_list(size) : &types[type]->pages
+        if region_active do list = region_page_list(list)
+        void* o = alloc_cell(list)
+        allocations_count++
+        allocations_size += list->cell_size
+        no_gc_allocated += list->cell_size
+        PLf("o = %p, type = %d, cell_size = %d", o, type, list->cell_size)
+        return o
+    if size >= LARGE_SIZE_MIN do
+        void* o = alloc_large(type, count, size)
+        allocations_count++
+        allocations_size += size
+        no_gc_allocated += size
+        return o
+    void* p = calloc(1, header_size(count, type) + size)
+    if p == NULL do
         // if could not get memory, collect and try again
         gc_collect()
         // use xcalloc here to stop if fails again
-        a = xcalloc(1, sizeof(Allocation) + size)
-    set_count_type(a, count, type)
+        p = xcalloc(1, header_size(count, type) + size)
+    Allocation* a = init_header(p, count, type)
     assert("is aligned", is_alloc_aligned(a))
-    tr_insert(&allocations, a)
+    log_allocation(a)
+    extend_bounds(a, a->object + size)
     allocations_count++
     allocations_size += size
+    no_gc_allocated += size
     PLf("a = %p, o = %p, type = %p", a, a->object, types[type])
-    ensure("inserted", tr_contains(allocations, a))
+    ensure("logged", allocation_log[allocation_log_count - 1] == a)
     return a->object
 
 // Allocates the given number of bytes.
 *void* gc_alloc(int size)
-    require("valid range", 0 < size && size <= 0xffffff)
+    require("valid range", 0 < size)
     return alloc(0, size)
 
 // Allocates an object of the given type.
@@ -161,48 +1395,362 @@ void* alloc(int type, int count)
 // Allocates an array of count objects of the given type.
 *void* gc_alloc_array(int type, int count)
     require("valid type", 1 <= type && type <= types_count)
-    require("valid range", 0 < count && count <= 0xffffff)
+    require("valid range", 0 < count)
     return alloc(type, count)
 
 // Checks if the garbge collector has any allocations.
 *bool gc_is_empty(void)
-    assert("valid state", trie_is_empty(allocations) == (allocations_count == 0))
-    return trie_is_empty(allocations)
+    bool empty = (allocations_table_count == 0 && allocation_log_count == 0 && trie_is_empty(pages)
+            && large_objects_count == 0)
+    assert("valid state", empty == (allocations_count == 0))
+    return empty
 
 // Checks if the set of roots contains o.
 *bool gc_contains_root(void* o)
     require_not_null(o)
-    Allocation* a = allocation_address(o)
-    return is_alloc_aligned(a) && tr_contains(roots, a)
+    return ((uint64_t)o & 7) == 0 && rt_contains(roots, o)
 
-// Adds an object as a root object.
+// Adds an object as a root object. Handles (see gc_new_handle) are cheaper for short-lived roots.
 *void gc_add_root(void* o)
     require_not_null(o)
-    Allocation* a = allocation_address(o)
-    assert("is aligned", is_alloc_aligned(a))
-    assert("is allocation", tr_contains(allocations, a))
-    tr_insert(&roots, a)
-    ensure("is a root", tr_contains(roots, a))
+    assert("is aligned", ((uint64_t)o & 7) == 0)
+    assert("is object", is_object(o))
+    rt_insert(&roots, o)
+    ensure("is a root", rt_contains(roots, o))
 
 // Removes an object from the set of root objects.
 *void gc_remove_root(void* o)
     require_not_null(o)
-    Allocation* a = allocation_address(o)
-    assert("is aligned", is_alloc_aligned(a))
-    tr_remove(&roots, a)
-    ensure("is not a root", !tr_contains(roots, a))
+    assert("is aligned", ((uint64_t)o & 7) == 0)
+    rt_remove(&roots, o)
+    ensure("is not a root", !rt_contains(roots, o))
+
+/*
+Root handles. A handle is an index into a dense table of root objects. Unused
+entries form a free list. An unused entry stores the index of the next unused
+entry, shifted left by one bit and with the LSB set, which distinguishes it from
+an object pointer. Handles are allocated and freed in constant time and the
+roots are marked by a linear scan of the table. Handle 0 is never used.
+*/
+*typedef int gc_handle_t
+
+void** handles = NULL
+int handles_count = 0
+int handles_capacity = 0
+int handles_free = 0 // first unused entry, 0 if none
+
+#define is_free_handle(x) (((uint64_t)(x) & 1) == 1)
+#define free_handle_entry(next) ((void*)(((uint64_t)(next) << 1) | 1))
+#define next_free_handle(x) ((int)((uint64_t)(x) >> 1))
+
+// Creates a handle that keeps o alive until the handle is freed. o may be NULL.
+*gc_handle_t gc_new_handle(void* o)
+    assert("is object", o == NULL || is_object(o))
+    int h = handles_free
+    if h != 0 do
+        handles_free = next_free_handle(handles[h])
+    else
+        if handles_count == 0 do handles_count = 1 // skip handle 0
+        if handles_count >= handles_capacity do
+            int capacity = handles_capacity == 0 ? 256 : 2 * handles_capacity
+            void** table = realloc(handles, capacity * sizeof(void*))
+            if table == NULL do panic("Cannot allocate memory.")
+            handles = table
+            handles_capacity = capacity
+        h = handles_count++
+    handles[h] = o
+    return h
+
+// Frees a handle. The object is no longer kept alive by the handle.
+*void gc_free_handle(gc_handle_t h)
+    require("valid handle", 0 < h && h < handles_count && !is_free_handle(handles[h]))
+    handles[h] = free_handle_entry(handles_free)
+    handles_free = h
+
+// Returns the object of a handle.
+*void* gc_handle_get(gc_handle_t h)
+    require("valid handle", 0 < h && h < handles_count && !is_free_handle(handles[h]))
+    return handles[h]
+
+// Replaces the object of a handle. o may be NULL.
+*void gc_handle_set(gc_handle_t h, void* o)
+    require("valid handle", 0 < h && h < handles_count && !is_free_handle(handles[h]))
+    assert("is object", o == NULL || is_object(o))
+    handles[h] = o
+
+/*
+Weak references. A weak reference is a managed object that holds a pointer to
+another object without keeping it alive. Its type has no pointers, so marking
+ignores the target. All weak references are registered in a table. After
+marking, references to unmarked objects are cleared, before objects with
+finalizers are resurrected. References that are garbage themselves are removed
+from the table before sweeping.
+*/
+int weak_ref_type = 0
+void*** weak_refs = NULL
+int weak_refs_count = 0
+int weak_refs_capacity = 0
+
+// Allocates a weak reference to o. o may be NULL.
+*void* gc_alloc_weak_ref(void* o)
+    assert("is object", o == NULL || is_object(o))
+    if weak_ref_type == 0 do weak_ref_type = gc_new_type(sizeof(void*), 0)
+    void** r = alloc(weak_ref_type, 1)
+    *r = o
+    if weak_refs_count >= weak_refs_capacity do
+        int capacity = weak_refs_capacity == 0 ? 256 : 2 * weak_refs_capacity
+        void*** table = realloc(weak_refs, capacity * sizeof(void**))
+        if table == NULL do panic("Cannot allocate memory.")
+        weak_refs = table
+        weak_refs_capacity = capacity
+    weak_refs[weak_refs_count++] = r
+    return r
+
+// Returns the target of a weak reference, NULL if it has been collected.
+*void* gc_weak_get(void* ref)
+    require_not_null(ref)
+    return *(void**)ref
+
+/*
+Ephemeron tables map keys to values, where a value is only reachable if its
+key is reachable, e.g., for memoization. A table is a hash table with linear
+probing over a managed array of ephemerons, keyed by object address (objects
+do not move). An ephemeron is a managed object that holds a key and a value,
+its type has no pointers. Ephemerons with a key are registered in a table of
+all ephemerons. Marking marks the values of marked ephemerons with marked keys
+until no more values get marked. Then the ephemerons with unmarked keys are
+cleared. Cleared ephemerons stay in their table until it is rebuilt.
+*/
+typedef struct Ephemeron Ephemeron
+struct Ephemeron
+    void* key // not traced
+    void* value // traced if the key is marked
+
+typedef struct EphemeronTable EphemeronTable
+struct EphemeronTable
+    int count // number of used entries, including cleared ephemerons
+    int capacity // number of entries, a power of two
+    Ephemeron** entries // managed array of ephemerons
+
+int ephemeron_type = 0
+int ephemeron_table_type = 0
+int ephemeron_entries_type = 0
+Ephemeron** ephemerons = NULL
+int ephemerons_count = 0
+int ephemerons_capacity = 0
+
+#define EPHEMERON_TABLE_CAPACITY_MIN 16
+
+// Allocates a new, empty ephemeron table.
+*void* gc_new_ephemeron_table(void)
+    if ephemeron_type == 0 do
+        ephemeron_type = gc_new_type(sizeof(Ephemeron), 0)
+        ephemeron_table_type = gc_new_type(sizeof(EphemeronTable), 1)
+        gc_set_offset(ephemeron_table_type, 0, offsetof(EphemeronTable, entries))
+        ephemeron_entries_type = gc_new_pointer_array_type()
+    GC_FRAME
+    Ephemeron** entries = alloc(ephemeron_entries_type, EPHEMERON_TABLE_CAPACITY_MIN)
+    GC_LOCAL(entries) // the allocation of the table may collect
+    EphemeronTable* t = alloc(ephemeron_table_type, 1)
+    t->entries = entries
+    t->capacity = EPHEMERON_TABLE_CAPACITY_MIN
+    return t
+
+// Returns the index of the entry with the key or of the empty entry where it would be inserted.
+int ephemeron_index(EphemeronTable* t, void* key)
+    uint64_t h = ((uint64_t)key >> 3) * 0x9e3779b97f4a7c15ull
+    int mask = t->capacity - 1
+    int i = (int)(h >> 32) & mask
+    while t->entries[i] != NULL && t->entries[i]->key != key do
+        i = (i + 1) & mask
+    return i
+
+/*
+Rebuilds the entries array of the table without the cleared ephemerons. The
+capacity is doubled if more than half of the remaining entries are used.
+*/
+void rebuild_ephemeron_table(EphemeronTable* t)
+    int live = 0
+    for int i = 0; i < t->capacity; i++ do
+        live += t->entries[i] != NULL && t->entries[i]->key != NULL
+    int capacity = t->capacity
+    if 4 * (live + 1) > capacity do capacity *= 2
+    Ephemeron** entries = alloc(ephemeron_entries_type, capacity) // may collect, clearing ephemerons
+    Ephemeron** old = t->entries
+    int old_capacity = t->capacity
+    t->entries = entries
+    t->capacity = capacity
+    t->count = 0
+    for int i = 0; i < old_capacity; i++ do
+        Ephemeron* e = old[i]
+        if e != NULL && e->key != NULL do
+            t->entries[ephemeron_index(t, e->key)] = e
+            t->count++
+
+// Associates value with key in the table. Keeps value alive only as long as key is alive.
+*void gc_ephemeron_put(void* table, void* key, void* value)
+    require_not_null(table)
+    require_not_null(key)
+    assert("is object", is_object(key))
+    assert("is object", value == NULL || is_object(value))
+    EphemeronTable* t = table
+    int i = ephemeron_index(t, key)
+    if t->entries[i] != NULL do
+        t->entries[i]->value = value
+        return
+    if 2 * (t->count + 1) > t->capacity do
+        rebuild_ephemeron_table(t)
+    Ephemeron* e = alloc(ephemeron_type, 1) // may collect, does not move entries
+    e->key = key
+    e->value = value
+    i = ephemeron_index(t, key)
+    t->entries[i] = e
+    t->count++
+    if ephemerons_count >= ephemerons_capacity do
+        int capacity = ephemerons_capacity == 0 ? 256 : 2 * ephemerons_capacity
+        Ephemeron** list = realloc(ephemerons, capacity * sizeof(Ephemeron*))
+        if list == NULL do panic("Cannot allocate memory.")
+        ephemerons = list
+        ephemerons_capacity = capacity
+    ephemerons[ephemerons_count++] = e
+
+// Returns the value associated with key in the table or NULL if there is none.
+*void* gc_ephemeron_get(void* table, void* key)
+    require_not_null(table)
+    require_not_null(key)
+    EphemeronTable* t = table
+    Ephemeron* e = t->entries[ephemeron_index(t, key)]
+    return e != NULL ? e->value : NULL
+
+/*
+Finalizers release resources (e.g., file descriptors) of objects that have
+become unreachable. After marking and clearing the weak references, unmarked
+objects with a finalizer are moved to the finalization queue and marked again
+(resurrected), together with the objects they refer to. Weak references to them
+stay cleared. The queued objects are roots until their finalizers have
+run. The finalizers are run by gc_run_finalizers, outside of the collection. A
+finalized object is freed by the next collection in which it is unreachable.
+*/
+*typedef void (*GCFinalizer)(void* o)
+
+typedef struct Finalizer Finalizer
+struct Finalizer
+    void* o // object to finalize
+    GCFinalizer fn // finalizer function
+
+Finalizer* finalizers = NULL // registered finalizers of objects that have not been found unreachable
+int finalizers_count = 0
+int finalizers_capacity = 0
+Finalizer* finalization_queue = NULL // entries from queue_head to queue_count are pending
+int queue_head = 0
+int queue_count = 0
+int queue_capacity = 0
+bool running_finalizers = false
+
+// Appends a finalizer to the table (finalizers or queue) and returns the table.
+Finalizer* append_finalizer(Finalizer* table, int* count, int* capacity, Finalizer f)
+    if *count >= *capacity do
+        int new_capacity = *capacity == 0 ? 64 : 2 * *capacity
+        table = realloc(table, new_capacity * sizeof(Finalizer))
+        if table == NULL do panic("Cannot allocate memory.")
+        *capacity = new_capacity
+    table[(*count)++] = f
+    return table
+
+/*
+Registers a finalizer for o. When o becomes unreachable, fn(o) is called by
+gc_run_finalizers. The finalizer must not make o reachable again. A finalizer
+is called at most once.
+*/
+*void gc_register_finalizer(void* o, GCFinalizer fn)
+    require_not_null(fn)
+    assert("is object", is_object(o))
+    finalizers = append_finalizer(finalizers, &finalizers_count, &finalizers_capacity, (Finalizer){o, fn})
+
+/*
+Runs the finalizers of the queued objects. Call regularly, e.g. after
+allocation-intensive phases or from an event loop. Finalizers may allocate.
+Returns the number of finalizers that have been run.
+*/
+*int gc_run_finalizers(void)
+    if running_finalizers do return 0 // called by a finalizer
+    running_finalizers = true
+    int n = 0
+    while queue_head < queue_count do
+        Finalizer f = finalization_queue[queue_head]
+        f.fn(f.o) // the object stays queued (alive) while its finalizer runs
+        queue_head++
+        n++
+    queue_head = 0
+    queue_count = 0
+    running_finalizers = false
+    return n
+
+/*
+Root ranges are memory regions outside the managed heap, such as global tables
+or malloc'd buffers, that contain pointers to managed objects. An untyped range
+(type 0) is scanned conservatively, like the stack. A typed range holds count
+instances of a type and only the pointers of the type are scanned.
+*/
+typedef struct RootRange RootRange
+struct RootRange
+    char* start // first byte of the range
+    uint64_t size // byte size of the range
+    int type // type of the instances in the range (0: untyped)
+
+RootRange* root_ranges = NULL
+int root_ranges_count = 0
+int root_ranges_capacity = 0
+
+void add_root_range(char* start, uint64_t size, int type)
+    if root_ranges_count >= root_ranges_capacity do
+        int capacity = root_ranges_capacity == 0 ? 16 : 2 * root_ranges_capacity
+        RootRange* table = realloc(root_ranges, capacity * sizeof(RootRange))
+        if table == NULL do panic("Cannot allocate memory.")
+        root_ranges = table
+        root_ranges_capacity = capacity
+    root_ranges[root_ranges_count++] = (RootRange){start, size, type}
+
+// Adds a memory region of the given byte size that is scanned conservatively for pointers to managed objects.
+*void gc_add_root_range(void* start, uint64_t size)
+    require_not_null(start)
+    add_root_range(start, size, 0)
+
+/*
+Adds a memory region that holds count instances of the given type. Only the
+pointers of the type are scanned.
+*/
+*void gc_add_typed_root_range(void* start, int type, int count)
+    require_not_null(start)
+    require("valid type", 1 <= type && type <= types_count)
+    require("valid count", count > 0)
+    require("not empty", types[type]->size > 0)
+    add_root_range(start, (uint64_t)count * types[type]->size, type)
+
+// Removes the root range that starts at the given address.
+*void gc_remove_root_range(void* start)
+    require_not_null(start)
+    for int i = 0; i < root_ranges_count; i++ do
+        if root_ranges[i].start == start do
+            root_ranges[i] = root_ranges[--root_ranges_count]
+            return
 
 // Prints the current allocations.
-bool f_print(uint64_t x, void* context)
-    Allocation* a = (Allocation*)(x << 3)
+void print_allocation(Allocation* a)
     printf("\ta = %p, o = %p, count = %d, marked = %d\n", a, a->object, get_count(a), is_marked(a))
-    return true
+void print_pages(PageList* list)
+    for Page* page = list->first; page != NULL; page = page->next do
+        printf("\tpage = %p, type = %d, cell_size = %d, cells = %d, allocated = %d\n",
+                page, page->type, page->cell_size, page->cell_count, page->cell_count - page->free_count)
 void print_allocations(void)
     printf("print_allocations:\n")
-    if trie_is_empty(allocations) do
-        printf("\tno allocations\n")
-    else
-        trie_visit(&allocations, f_print, NULL)
+    flush_allocation_log()
+    if allocations_table_count == 0 do printf("\tno allocations\n")
+    for int i = 0; i < allocations_table_count; i++ do print_allocation(allocations[i])
+    for int t = 1; t <= types_count; t++ do print_pages(&types[t]->pages)
+    for int c = 0; c < CELL_SIZE_MAX / UNTYPED_CELL_SIZE_STEP; c++ do print_pages(untyped_pages + c)
+    for int i = 0; i < large_objects_count; i++ do
+        print_allocation(large_objects[i].a)
 
 /*
 Allocates a new type with the given size of the user object and the given number
@@ -212,47 +1760,231 @@ size should respect the requirements of alignment, if used with arrays. The
 pointer table is initialized to zeros.
 */
 *int gc_new_type(int size, int pointer_count)
-    require("types not full", types_count < 0x7f)
     require("not negative", size >= 0)
-    require("valid range", 0 <= pointer_count && pointer_count <= 0xff)
+    require("not negative", pointer_count >= 0)
     require("valid size for number of pointers", pointer_count * sizeof(void*) <= size)
+    if types_count + 1 >= types_capacity do
+        int capacity = types_capacity == 0 ? 0x80 : 2 * types_capacity
+        Type** table = realloc(types, capacity * sizeof(Type*))
+        if table == NULL do panic("Cannot allocate memory.")
+        memset(table + types_capacity, 0, (capacity - types_capacity) * sizeof(Type*))
+        types = table
+        types_capacity = capacity
     Type* t = xcalloc(1, sizeof(Type) + pointer_count * sizeof(int))
     t->size = size
     t->pointer_count = pointer_count
     types_count++
     types[types_count] = t
+    t->pages.type = types_count
+    t->pages.cell_size = size < 8 ? 8 : (size + 7) & ~7
     return types_count
 
+/*
+Allocates a new type for arrays of managed pointers. Arrays of this type are
+allocated with gc_alloc_array and are scanned as a whole, rather than element by
+element.
+*/
+*int gc_new_pointer_array_type(void)
+    int type = gc_new_type(sizeof(void*), 1)
+    types[type]->kind = TYPE_POINTER_ARRAY
+    return type
+
+/*
+Allocates a new type of the given size whose managed pointers are given by a
+bitmap: bit i is set if the i-th word of the object is a managed pointer. The
+size is at most 64 words. The pointer table is derived from the bitmap.
+*/
+*int gc_new_bitmap_type(int size, uint64_t bitmap)
+    require("valid size", 0 <= size && size <= 64 * sizeof(void*))
+    require("bitmap within size", size / 8 == 64 || (bitmap >> (size / 8)) == 0)
+    int type = gc_new_type(size, __builtin_popcountll(bitmap))
+    Type* t = types[type]
+    t->kind = TYPE_BITMAP
+    t->bitmap = bitmap
+    int j = 0
+    for int i = 0; i < 64; i++ do
+        if bitmap & (1ull << i) do t->pointers[j++] = i * sizeof(void*)
+    return type
+
+/*
+Sets a trace function for the type. The function is called for each object of
+the type during marking and has to call gc_trace_pointer for each managed
+pointer of the object. It must not allocate. See gc_trace.h for macros
+that generate trace functions.
+*/
+*void gc_set_trace_fn(int type, GCTraceFn fn)
+    require("valid type", 1 <= type && type <= types_count)
+    types[type]->trace = fn
+
+/*
+Allocates a new tag scheme. Word w is a tagged pointer if (w & tag_mask) ==
+tag_value, the pointer is (w & pointer_mask) << shift. For example, small
+integers with the low bit set and raw pointers otherwise: (1, 0, ~0ull, 0).
+Returns the tag scheme for gc_set_tagged_offset.
+*/
+*int gc_new_tag_scheme(uint64_t tag_mask, uint64_t tag_value, uint64_t pointer_mask, int shift)
+    require("tag schemes not full", tag_schemes_count < 0xff)
+    require("tag value within mask", (tag_value & ~tag_mask) == 0)
+    require("valid shift", 0 <= shift && shift < 64)
+    tag_schemes_count++
+    tag_schemes[tag_schemes_count] = (TagScheme){tag_mask, tag_value, pointer_mask, shift}
+    return tag_schemes_count
+
 // Sets the offset of i-th the pointer to managed memory.
 *void gc_set_offset(int type, int index, int offset)
     require("valid type", 1 <= type && type <= types_count)
     Type* t = types[type]
+    require("offsets type", t->kind == TYPE_OFFSETS)
     require("valid index", 0 <= index && index < t->pointer_count)
     require("valid offset", 0 <= offset && offset + sizeof(void*) <= t->size)
     t->pointers[index] = offset
 
 /*
-Sweeps the marked allocations and either clears the mark or deletes the
-allocation.
+Sets the offset of the i-th pointer to managed memory, which is encoded
+according to the tag scheme. Objects of types with tagged pointers are not
+traced by pointer reversal.
 */
+*void gc_set_tagged_offset(int type, int index, int offset, int scheme)
+    require("valid tag scheme", 0 <= scheme && scheme <= tag_schemes_count)
+    gc_set_offset(type, index, offset)
+    Type* t = types[type]
+    if t->tags == NULL do t->tags = xcalloc(t->pointer_count, sizeof(unsigned char))
+    t->tags[index] = scheme
+
 typedef struct {uint64_t count, size;} CountSize
-bool f_sweep(uint64_t x, void* context)
-    Allocation* a = (Allocation*)(x << 3)
-    if is_marked(a) do
-        clear_marked(a)
-        return true // keep
-    else
-        PLf("free a = %p, o = %p", a, a->object)
-        CountSize* freed = context
-        freed->count++
-        freed->size += allocation_size(a)
-        free(a)
-        return false // remove
+
+/*
+Sweeps the allocations table. Marked allocations are unmarked, unmarked ones
+are freed and removed from the table.
+*/
+void sweep_allocations(CountSize* freed)
+    int n = 0
+    for int i = 0; i < allocations_table_count; i++ do
+        Allocation* a = allocations[i]
+        if is_marked(a) do
+            clear_marked(a)
+            allocations[n++] = a
+        else
+            PLf("free a = %p, o = %p", a, a->object)
+            freed->count++
+            freed->size += allocation_size(a)
+            free(allocation_start(a))
+    allocations_table_count = n
+
+/*
+Sweeps the cells of a page. Unmarked allocated cells are freed and marked cells
+are unmarked. If cells have been freed, the list of freed cells is rebuilt in
+address order.
+*/
+void sweep_page(Page* page, CountSize* freed)
+    int words = bitmap_words(page->cell_count)
+    int dead = 0
+    for int w = 0; w < words; w++ do
+        uint64_t live = page->allocated[w] & page->marked[w]
+        dead += __builtin_popcountll(page->allocated[w] & ~live)
+        page->allocated[w] = live
+        page->marked[w] = 0
+    if dead == 0 do return
+    PLf("page = %p, dead = %d", page, dead)
+    freed->count += dead
+    freed->size += (uint64_t)dead * page->cell_size
+    page->free_count += dead
+    page->free_list = NULL
+    int bumped = (page->bump - page->cells) / page->cell_size
+    for int k = bumped - 1; k >= 0; k-- do
+        if !test_bit(page->allocated, k) do
+            char* cell = page->cells + k * page->cell_size
+            *(char**)cell = page->free_list
+            page->free_list = cell
+
+/*
+Sweeps the pages of the list. Pages without allocated cells are released. The
+list of pages that have unallocated cells is rebuilt.
+*/
+void sweep_pages(PageList* list, CountSize* freed, uint64_t now)
+    Page** pp = &list->first
+    Page** pa = &list->available
+    while *pp != NULL do
+        Page* page = *pp
+        sweep_page(page, freed)
+        if page->free_count == page->cell_count do
+            *pp = page->next
+            pg_remove(&pages, page)
+            pages_count--
+            release_page(page, now)
+        else
+            if page->free_count > 0 do
+                *pa = page
+                pa = &page->next_available
+            pp = &page->next
+    *pa = NULL
+
+// Checks whether a cell of the page is marked.
+bool page_has_marked(Page* page)
+    int words = bitmap_words(page->cell_count)
+    for int w = 0; w < words; w++ do
+        if page->marked[w] != 0 do return true
+    return false
+
+// Returns the page list that the cells of the page belong to outside of regions.
+PageList* page_list_of(Page* page)
+    if page->type == 0 do return untyped_page_list(page->cell_size)
+    return &types[page->type]->pages
+
+/*
+Releases the pages of the closed regions that have no marked cells, page by
+page. The pages of the other closed regions are returned to their page lists,
+to be swept as usual.
+*/
+void sweep_regions(CountSize* freed, uint64_t now)
+    for int i = 0; i < closed_regions_count; i++ do
+        bool escaped = false
+        for Page* page = closed_regions[i]; page != NULL && !escaped; page = page->next do
+            escaped = page_has_marked(page)
+        Page* page = closed_regions[i]
+        while page != NULL do
+            Page* next = page->next
+            if escaped do
+                PageList* list = page_list_of(page)
+                page->next = list->first
+                list->first = page
+            else
+                int count = page->cell_count - page->free_count
+                freed->count += count
+                freed->size += (uint64_t)count * page->cell_size
+                pg_remove(&pages, page)
+                pages_count--
+                release_page(page, now)
+            page = next
+    closed_regions_count = 0
+
+// Sweeps the large objects. Unmarked large objects are unmapped.
+void sweep_large_objects(CountSize* freed)
+    int n = 0
+    for int i = 0; i < large_objects_count; i++ do
+        Allocation* a = large_objects[i].a
+        if is_marked(a) do
+            clear_marked(a)
+            large_objects[n++] = large_objects[i]
+        else
+            PLf("unmap a = %p, o = %p", a, a->object)
+            freed->count++
+            freed->size += allocation_size(a)
+            munmap(allocation_start(a), large_objects[i].size)
+    large_objects_count = n
+
 void __attribute__((noinline)) sweep(void)
     CountSize freed = {0, 0}
+    uint64_t now = now_ms()
     ensure_code(uint64_t count_old = allocations_count)
     ensure_code(uint64_t size_old = allocations_size)
-    trie_visit(&allocations, f_sweep, &freed)
+    sweep_allocations(&freed)
+    sweep_regions(&freed, now)
+    for int i = 0; i < region_owners_count; i++ do sweep_pages(region_owners[i]->region, &freed, now)
+    for int t = 1; t <= types_count; t++ do sweep_pages(&types[t]->pages, &freed, now)
+    for int c = 0; c < CELL_SIZE_MAX / UNTYPED_CELL_SIZE_STEP; c++ do sweep_pages(untyped_pages + c, &freed, now)
+    sweep_large_objects(&freed)
+    purge_dirty_pages(now)
     allocations_count -= freed.count
     allocations_size -= freed.size
     PLf("freed.count = %llu, freed.size = %llu, allocs.count = %llu, allocs.size = %llu\n",
@@ -260,92 +1992,550 @@ void __attribute__((noinline)) sweep(void)
     ensure("not larger", allocations_count <= count_old)
     ensure("not larger", allocations_size <= size_old)
 
-// Marks all allocations reachable from a, including a itself.
-void mark(Allocation* a)
-    PLf("frame address = %p", __builtin_frame_address(0))
-    require_not_null(a)
-    require("is allocation", is_alloc_aligned(a) && tr_contains(allocations, a))
-    PLf("marking o = %p, a = %p, count = %d, marked = %d", a->object, a, a->count, is_marked(a))
-    if is_marked(a) do return
-    set_marked(a)
-    Type* t = types[get_type(a)]
-    if t == NULL do return
-    a->i_j = 0
-    Allocation* a_prev = NULL
-    while a != NULL do
-        int i = get_i(a)
-        int j = get_j(a)
-        while i < get_count(a) do // for all elements
+/*
+Helper functions for the mark state of objects. An object is either a cell
+(page != NULL) or the user object of an allocation with header (page == NULL).
+*/
+bool object_is_marked(char* o, Page* page)
+    if page == NULL do return is_marked(allocation_address(o))
+    return test_bit(page->marked, cell_index(page, o))
+
+void set_object_marked(char* o, Page* page)
+    if page == NULL do
+        set_marked(allocation_address(o))
+    else
+        set_bit(page->marked, cell_index(page, o))
+
+Type* object_type(char* o, Page* page)
+    if page == NULL do return types[get_type(allocation_address(o))]
+    return types[page->type]
+
+int object_count(char* o, Page* page)
+    if page == NULL do return get_count(allocation_address(o))
+    return 1
+
+// Cells are single objects, thus their element index i is always 0.
+void set_object_i_j(char* o, Page* page, int i, int j)
+    if page == NULL do
+        Allocation* a = allocation_address(o)
+        set_i_j(a, i, j)
+    else
+        assert("single object", i == 0)
+        page->js[cell_index(page, o)] = j
+
+void get_object_i_j(char* o, Page* page, int* i, int* j)
+    if page == NULL do
+        Allocation* a = allocation_address(o)
+        *i = get_i(a)
+        *j = get_j(a)
+    else
+        *i = 0
+        *j = page->js[cell_index(page, o)]
+
+/*
+The mark stack holds marked objects whose pointers still have to be traced.
+Objects of types with a trace function or a descriptor other than pointer
+offsets, objects with many pointers, and large arrays are traced via the mark
+stack, all other objects by pointer reversal. Large arrays are traced in chunks
+of MARK_CHUNK_SIZE bytes, the rest of the array is pushed back onto the stack.
+*/
+typedef struct MarkEntry MarkEntry
+struct MarkEntry
+    char* o // marked object
+    Page* page // page of the object, NULL if not a cell
+    int start // index of the first element that still has to be traced
+
+#define MARK_CHUNK_SIZE (64 * 1024)
+
+MarkEntry* mark_stack_entries = NULL
+int mark_stack_count = 0
+int mark_stack_capacity = 0
+
+// Pushes a marked object, from element start on, onto the mark stack.
+void push_marked(char* o, Page* page, int start)
+    if mark_stack_count >= mark_stack_capacity do
+        int capacity = mark_stack_capacity == 0 ? 1024 : 2 * mark_stack_capacity
+        MarkEntry* entries = realloc(mark_stack_entries, capacity * sizeof(MarkEntry))
+        if entries == NULL do panic("Cannot allocate memory.")
+        mark_stack_entries = entries
+        mark_stack_capacity = capacity
+    mark_stack_entries[mark_stack_count++] = (MarkEntry){o, page, start}
+
+/*
+Marks p and pushes it onto the mark stack, if it is not marked yet. Called by
+trace functions for each managed pointer. p may be NULL.
+*/
+*void gc_trace_pointer(void* p)
+    if p == NULL do return
+    Page* page = page_of(p)
+    assert("is object", is_object(p))
+    if object_is_marked(p, page) do return
+    set_object_marked(p, page)
+    push_marked(p, page, 0)
+
+// Returns the pointer that the j-th pointer field of o holds, decoding tagged pointers, or NULL.
+char* pointer_field(char* o, Type* t, int j)
+    uint64_t w = *(uint64_t*)(o + t->pointers[j])
+    if t->tags == NULL || t->tags[j] == 0 do return (char*)w
+    TagScheme* s = tag_schemes + t->tags[j]
+    if (w & s->tag_mask) != s->tag_value do return NULL
+    return (char*)((w & s->pointer_mask) << s->shift)
+
+// Returns the number of elements of type t that are traced in one step.
+int chunk_count(Type* t)
+    return t->size < MARK_CHUNK_SIZE ? MARK_CHUNK_SIZE / (t->size > 0 ? t->size : 1) : 1
+
+/*
+Checks whether count objects of type t are traced by pointer reversal. The
+pointer index j of the iteration state has 8 bits, the element index i is
+limited by the chunk size. Reversal stores raw pointers in the pointer fields,
+which would lose the tags of tagged pointers.
+*/
+bool traced_by_reversal(Type* t, int count)
+    return (t->trace == NULL && t->kind == TYPE_OFFSETS && t->tags == NULL
+            && t->pointer_count <= 0xff && count <= chunk_count(t))
+
+// Traces the pointers at the offsets of t in count objects starting at o.
+void trace_offsets(char* o, Type* t, int count)
+    for int i = 0; i < count; i++ do
+        for int j = 0; j < t->pointer_count; j++ do
+            gc_trace_pointer(pointer_field(o + i * t->size, t, j))
+
+/*
+Traces the n words starting at w, all of which are managed pointers or NULL.
+Blocks of 8 words are filtered for non-NULL, aligned values without branches,
+which the compiler vectorizes, so that sparse arrays are skipped quickly.
+*/
+void trace_words(uint64_t* w, uint64_t n)
+    uint64_t i = 0
+    for ; i + 8 <= n; i += 8 do
+        unsigned mask = 0
+        for int k = 0; k < 8; k++ do
+            uint64_t x = w[i + k]
+            mask |= (unsigned)(x != 0 && (x & 7) == 0) << k
+        while mask != 0 do
+            int k = __builtin_ctz(mask)
+            mask &= mask - 1
+            gc_trace_pointer((void*)w[i + k])
+    for ; i < n; i++ do
+        uint64_t x = w[i]
+        if x != 0 && (x & 7) == 0 do gc_trace_pointer((void*)x)
+
+// Traces the words given by the bitmap of t in count objects starting at o.
+void trace_bitmap(char* o, Type* t, int count)
+    for int i = 0; i < count; i++ do
+        uint64_t* w = (uint64_t*)(o + i * t->size)
+        uint64_t bits = t->bitmap
+        while bits != 0 do
+            int k = __builtin_ctzll(bits)
+            bits &= bits - 1
+            gc_trace_pointer((void*)w[k])
+
+/*
+Traces the pointers of the marked object o by pointer reversal. All objects
+reachable from o are marked, except that objects of types that are not traced
+by pointer reversal are pushed onto the mark stack instead of being traversed. If o is a
+cell, then page is its page, otherwise page is NULL.
+*/
+void trace_reversal(char* o, Page* page)
+    Type* t = object_type(o, page)
+    int count = object_count(o, page)
+    assert("traced by reversal", t != NULL && traced_by_reversal(t, count))
+    int i = 0, j = 0
+    char* o_prev = NULL
+    while o != NULL do
+        while i < count do // for all elements
             while j < t->pointer_count do // for each pointer in i-th element
                 PLf("i = %d, j = %d", i, j)
                 int offset = t->pointers[j]
-                char** ppj = (char**)(a->object + i * t->size + offset)
+                char** ppj = (char**)(o + i * t->size + offset)
                 char* pj = *ppj
                 if pj != NULL do
-                    Allocation* aj = allocation_address(pj)
-                    assert("is allocation", is_alloc_aligned(aj) && tr_contains(allocations, aj))
-                    PLf("pj = %p, a = %p, count = %d, marked = %d\n", pj, aj, aj->count, is_marked(aj))
-                    // mark(aj) <-- avoid recursion, capture loop state and process aj
-                    if !is_marked(aj) do
-                        set_marked(aj)
-                        Type* tj = types[get_type(aj)]
-                        if tj != NULL do
-                            *ppj = (char*)a_prev
-                            set_i_j(a, i, j); a_prev = a
-                            a = aj; t = tj
+                    Page* pagej = page_of(pj)
+                    assert("is object", is_object(pj))
+                    PLf("pj = %p, page = %p, marked = %d\n", pj, pagej, object_is_marked(pj, pagej))
+                    // mark(pj) <-- avoid recursion, capture loop state and process pj
+                    if !object_is_marked(pj, pagej) do
+                        set_object_marked(pj, pagej)
+                        Type* tj = object_type(pj, pagej)
+                        if tj != NULL && !traced_by_reversal(tj, object_count(pj, pagej)) do
+                            push_marked(pj, pagej, 0)
+                        else if tj != NULL do
+                            *ppj = o_prev
+                            set_object_i_j(o, page, i, j); o_prev = o
+                            o = pj; page = pagej; t = tj; count = object_count(pj, pagej)
                             i = -1; break
                 j++
             j = 0; i++
-        Allocation* aj = a
-        a = a_prev
-        if a != NULL do
-            t = types[get_type(a)]
-            int i = get_i(a)
-            int j = get_j(a)
+        char* oj = o
+        o = o_prev
+        if o != NULL do
+            page = page_of(o)
+            t = object_type(o, page)
+            count = object_count(o, page)
+            get_object_i_j(o, page, &i, &j)
             int offset = t->pointers[j]
-            Allocation** ppj = (Allocation**)(a->object + i * t->size + offset)
-            a_prev = *ppj
-            *ppj = (Allocation*)aj->object
+            char** ppj = (char**)(o + i * t->size + offset)
+            o_prev = *ppj
+            *ppj = oj
             j++
             if j >= t->pointer_count do
                 i++
                 j = 0
-            set_i_j(a, i, j)
+
+/*
+Traces the pointers of the marked object o from element start on. At most one
+chunk of elements is traced, the rest is pushed onto the mark stack.
+*/
+void trace(char* o, Page* page, int start)
+    Type* t = object_type(o, page)
+    if t == NULL do return
+    int count = object_count(o, page)
+    if start == 0 && traced_by_reversal(t, count) do
+        trace_reversal(o, page)
+        return
+    int end = count - start > chunk_count(t) ? start + chunk_count(t) : count
+    if end < count do push_marked(o, page, end)
+    char* p = o + (uint64_t)start * t->size
+    int n = end - start
+    if t->trace != NULL do
+        for int i = 0; i < n; i++ do t->trace(p + i * t->size)
+    else if t->kind == TYPE_POINTER_ARRAY do
+        trace_words((uint64_t*)p, n)
+    else if t->kind == TYPE_BITMAP do
+        trace_bitmap(p, t, n)
+    else
+        trace_offsets(p, t, n)
+
+/*
+Marks all objects reachable from o, including o itself. If o is a cell, then
+page is its page, otherwise page is NULL.
+*/
+void mark(char* o, Page* page)
+    PLf("frame address = %p", __builtin_frame_address(0))
+    require_not_null(o)
+    require("is object", page_of(o) == page && is_object(o))
+    PLf("marking o = %p, page = %p, marked = %d", o, page, object_is_marked(o, page))
+    if object_is_marked(o, page) do return
+    set_object_marked(o, page)
+    trace(o, page, 0)
+    while mark_stack_count > 0 do
+        MarkEntry e = mark_stack_entries[--mark_stack_count]
+        trace(e.o, e.page, e.start)
+
+/*
+Checks whether p points to a managed object. If so, returns the object and
+sets *page to its page (or to NULL if the object is not a cell). Otherwise
+returns NULL. Pointers anywhere into an object (including its header) are
+recognized: cells are found by dividing the offset by the cell size, other
+objects by a binary search in the allocations table or in the table of large
+objects.
+*/
+char* find_object(uint64_t p, Page** page)
+    require_not_null(page)
+    *page = NULL
+    if p == 0 do return NULL
+    Page* pg = page_of((void*)p)
+    if pg != NULL do
+        if p < (uint64_t)pg->cells do return NULL
+        int k = cell_index(pg, p)
+        if k >= pg->cell_count || !test_bit(pg->allocated, k) do return NULL
+        *page = pg
+        return pg->cells + k * pg->cell_size
+    int i = large_object_index(p)
+    if i >= 0 do return large_objects[i].a->object
+    i = allocation_index(p)
+    if i >= 0 do return allocations[i]->object
+    return NULL
+
+/*
+Blacklists the page that p points to, if it is an unused page of a chunk.
+Returns true if the page has been blacklisted.
+*/
+bool blacklist_near_miss(uint64_t p)
+    if !in_chunk(p) do return false
+    Page* page = page_address(p)
+    if pg_contains(pages, page) do return false // in use
+    PLf("blacklist page = %p", page)
+    pg_insert(&blacklist_next, page)
+    return true
+
+/*
+Marks the object that p points to (if any) and all objects reachable from it.
+Returns the object or NULL. Sets *near_miss if p did not point to an object but
+blacklisted a page.
+*/
+char* mark_word(uint64_t p, Page** page, bool* near_miss)
+    *near_miss = false
+    char* o = find_object(p, page)
+    if o != NULL do
+        PLf("found object: p = %llx, page = %p", p, *page)
+        mark(o, *page)
+    else if blacklisting do
+        *near_miss = blacklist_near_miss(p)
+    return o
+
+// Marks the object that p points to (if any) and all objects reachable from it.
+void mark_conservative(uint64_t p)
+    if p < heap_lo || p >= heap_hi do return
+    Page* page
+    bool near_miss
+    mark_word(p, &page, &near_miss)
+
+// Marks the objects that the words from p (inclusive) to q (exclusive) may point to.
+void mark_range(uint64_t* p, uint64_t* q)
+    for ; p < q; p++ do
+        // is the value at address p a managed object?
+        mark_conservative(*p)
+
+// Marks the objects that the pointers of count instances of type t starting at o point to.
+void mark_typed_range(char* o, Type* t, int count)
+    for int i = 0; i < count; i++ do
+        for int j = 0; j < t->pointer_count; j++ do
+            char* pj = pointer_field(o + i * t->size, t, j)
+            if pj != NULL do
+                assert("is object", is_object(pj))
+                mark(pj, page_of(pj))
+
+// Marks the objects that the root ranges point to.
+void mark_root_ranges(void)
+    for int i = 0; i < root_ranges_count; i++ do
+        RootRange* r = root_ranges + i
+        if r->type == 0 do
+            // scan the aligned words of the range
+            uint64_t* p = (uint64_t*)(((uint64_t)r->start + 7) & ~7ull)
+            uint64_t* q = (uint64_t*)(((uint64_t)r->start + r->size) & ~7ull)
+            mark_range(p, q)
+        else
+            Type* t = types[r->type]
+            mark_typed_range(r->start, t, r->size / t->size)
+
+/*
+Data segments. In this (opt-in) mode, the writable segments of the executable
+and of the loaded shared objects (.data, .bss) are scanned conservatively, so
+global variables do not have to be registered as roots. The segments are
+enumerated with dl_iterate_phdr and cached. The cache is refreshed only when
+shared objects have been loaded or unloaded since it was built. The section of
+the collector's own globals (COLLECTOR_STATE) is left out. Only available on
+Linux.
+*/
+typedef struct DataSegment DataSegment
+struct DataSegment
+    uint64_t* start // first word of the segment
+    uint64_t* end // end of the segment (exclusive)
+
+DataSegment* data_segments = NULL
+int data_segments_count = 0
+int data_segments_capacity = 0
+bool scan_data_segments = false
+bool data_segments_valid = false
+uint64_t data_segments_adds = 0 // number of loaded objects when the cache was built
+uint64_t data_segments_subs = 0 // number of unloaded objects when the cache was built
+
+#ifdef __linux__
+// Bounds of the section of the collector's globals, defined by the linker.
+extern char __start_gc_collector_state[]
+extern char __stop_gc_collector_state[]
+
+// Checks whether objects have been loaded or unloaded. Only looks at the first object.
+int f_check_loaded(struct dl_phdr_info* info, size_t size, void* context)
+    bool* changed = context
+    if size < offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs) do
+        *changed = true // cannot tell, rebuild each time
+    else
+        *changed = info->dlpi_adds != data_segments_adds || info->dlpi_subs != data_segments_subs
+        data_segments_adds = info->dlpi_adds
+        data_segments_subs = info->dlpi_subs
+    return 1 // stop after the first object
+
+void append_data_segment(uint64_t start, uint64_t end)
+    if start >= end do return
+    if data_segments_count >= data_segments_capacity do
+        int capacity = data_segments_capacity == 0 ? 16 : 2 * data_segments_capacity
+        DataSegment* table = realloc(data_segments, capacity * sizeof(DataSegment))
+        if table == NULL do panic("Cannot allocate memory.")
+        data_segments = table
+        data_segments_capacity = capacity
+    data_segments[data_segments_count++] = (DataSegment){(uint64_t*)start, (uint64_t*)end}
+
+// Adds the segment from start to end (exclusive), without the section of the collector's globals.
+void add_data_segment(uint64_t start, uint64_t end)
+    uint64_t lo = (uint64_t)__start_gc_collector_state & ~7ull
+    uint64_t hi = ((uint64_t)__stop_gc_collector_state + 7) & ~7ull
+    if end <= lo || hi <= start do
+        append_data_segment(start, end)
+    else
+        append_data_segment(start, lo)
+        append_data_segment(hi, end)
+
+// Appends the writable loadable segments of an object.
+int f_add_segments(struct dl_phdr_info* info, size_t size, void* context)
+    for int i = 0; i < info->dlpi_phnum; i++ do
+        const ElfW(Phdr)* ph = info->dlpi_phdr + i
+        if ph->p_type != PT_LOAD || (ph->p_flags & PF_W) == 0 || ph->p_memsz == 0 do continue
+        uint64_t start = (info->dlpi_addr + ph->p_vaddr + 7) & ~7ull
+        uint64_t end = (info->dlpi_addr + ph->p_vaddr + ph->p_memsz) & ~7ull
+        add_data_segment(start, end)
+        PLf("%s: %llx-%llx", info->dlpi_name, start, end)
+    return 0
+
+// Rebuilds the cache of data segments if objects have been loaded or unloaded.
+void refresh_data_segments(void)
+    bool changed = true
+    dl_iterate_phdr(f_check_loaded, &changed)
+    if data_segments_valid && !changed do return
+    data_segments_count = 0
+    dl_iterate_phdr(f_add_segments, NULL)
+    data_segments_valid = true
+#else
+void refresh_data_segments(void)
+    data_segments_count = 0
+    data_segments_valid = true
+#endif
+
+/*
+Enables or disables blacklisting of unused pages that conservative scanning
+finds pointers into (enabled by default).
+*/
+*void gc_set_blacklisting(bool enabled)
+    blacklisting = enabled
+
+/*
+Enables or disables conservative scanning of the data segments of the
+executable and of the loaded shared objects.
+*/
+*void gc_set_scan_data_segments(bool scan)
+    scan_data_segments = scan
+
+// Marks the objects that the data segments point to.
+void mark_data_segments(void)
+    if !scan_data_segments do return
+    refresh_data_segments()
+    for int i = 0; i < data_segments_count; i++ do
+        mark_range(data_segments[i].start, data_segments[i].end)
 
 // Marks all root objects and all objects that are reachable from them.
 bool f_mark_roots(uint64_t x, void* context)
-    PLf("%llx", x << 3)
-    Allocation* r = (Allocation*)(x << 3)
-    mark(r)
+    PLf("%llx", x << 2)
+    char* r = (char*)(x << 2)
+    mark(r, page_of(r))
     return true // keep
 void mark_roots(void)
     trie_visit(&roots, f_mark_roots, NULL)
+    for int h = 1; h < handles_count; h++ do
+        char* o = handles[h]
+        if o != NULL && !is_free_handle(o) do mark(o, page_of(o))
+    for int i = queue_head; i < queue_count; i++ do
+        char* o = finalization_queue[i].o
+        mark(o, page_of(o))
+    mark_root_ranges()
+    mark_data_segments()
 
 /*
-Marks registers and returns its own frame address. mark_registers has its own
-stack frame (noinline). It is called by mark_stack and thus its frame address is
-below (in memory) the frame of mark_stack. The frame address of mark_registers
-serves as the top_of_stack (lowest address) for scanning the stack.
+The scan cache remembers the result of the last scan of the running stack for
+each word within the heap bounds: the slot, its value, and the object that it
+pointed to (or NULL). Frames deep in the stack rarely change between
+collections. If a slot still has the same value, the cached result is reused
+without a lookup. A cached object is still valid, because it was marked and thus
+has not been freed. A cached miss is still valid unless the value points into
+memory that has been handed out since the last collection (fresh bounds).
+Return barriers would avoid reading unchanged frames at all, but C code may
+write into deep frames through pointers, which return barriers do not notice.
 */
-uint64_t* __attribute__((noinline)) mark_registers(void)
+typedef struct ScanEntry ScanEntry
+struct ScanEntry
+    uint64_t* slot // address of the stack word
+    uint64_t value // value of the stack word
+    char* object // object that the value points to, NULL if none
+    Page* page // page of the object, NULL if not a cell
+    bool near_miss // the value blacklisted a page
+
+ScanEntry* scan_cache = NULL
+ScanEntry* scan_next = NULL
+int scan_cache_count = 0
+int scan_capacity = 0
+gc_stack_t scan_cache_stack = -1 // stack that the scan cache belongs to
+uint64_t scan_cache_collection = UINT64_MAX // collection that the scan cache belongs to
+
+/*
+Scans the running stack from top (inclusive) to bottom (exclusive), reusing the
+results of the last scan for unchanged words.
+*/
+void mark_stack_cached(uint64_t* top, uint64_t* bottom)
+    // the cache is only valid if it was built by the previous collection
+    bool valid = scan_cache_stack == current_stack && scan_cache_collection + 1 == collections_count
+    int count = valid ? scan_cache_count : 0
+    int c = 0, n = 0, reused = 0
+    for uint64_t* p = top; p < bottom; p++ do
+        uint64_t v = *p
+        if v < heap_lo || v >= heap_hi do continue
+        if n >= scan_capacity do
+            int capacity = scan_capacity == 0 ? 256 : 2 * scan_capacity
+            ScanEntry* cache = realloc(scan_cache, capacity * sizeof(ScanEntry))
+            if cache != NULL do scan_cache = cache
+            ScanEntry* next = realloc(scan_next, capacity * sizeof(ScanEntry))
+            if next != NULL do scan_next = next
+            if cache == NULL || next == NULL do panic("Cannot allocate memory.")
+            scan_capacity = capacity
+        while c < count && scan_cache[c].slot < p do c++
+        ScanEntry* e = scan_next + n++
+        if c < count && scan_cache[c].slot == p && scan_cache[c].value == v && (v < fresh_lo || v >= fresh_hi) do
+            *e = scan_cache[c]
+            reused++
+            if e->object != NULL do
+                mark(e->object, e->page)
+            else if e->near_miss do
+                pg_insert(&blacklist_next, page_address(v))
+        else
+            e->slot = p
+            e->value = v
+            e->object = mark_word(v, &e->page, &e->near_miss)
+    ScanEntry* t = scan_cache; scan_cache = scan_next; scan_next = t
+    scan_cache_count = n
+    scan_cache_stack = current_stack
+    scan_cache_collection = collections_count
+    PLf("candidates = %d, reused = %d", n, reused)
+
+// Scans the used regions and the register contexts of the suspended stacks.
+void mark_suspended_stacks(void)
+    int n = suspended_stacks_count
+    for int h = 0; n > 0 && h < stacks_count; h++ do
+        Stack* s = stacks + h
+        if s->state != STACK_SUSPENDED do continue
+        n--
+        mark_range((uint64_t*)((uint64_t)s->sp & ~7ull), (uint64_t*)((uint64_t)s->hi & ~7ull))
+        if s->context != NULL do
+            uint64_t* p = (uint64_t*)(((uint64_t)s->context + 7) & ~7ull)
+            mark_range(p, (uint64_t*)(((uint64_t)s->context + s->context_size) & ~7ull))
+
+/*
+Scans the running stack from its own frame address (top_of_stack, the lowest
+address) to the bottom of the stack. It has its own stack frame (noinline) and
+is called by mark_registers, so the frame of mark_registers, which holds the
+saved registers, lies within the scanned range.
+*/
+void __attribute__((noinline)) mark_running_stack(void)
     // https://gcc.gnu.org/onlinedocs/gcc/Return-Address.html
     uint64_t* top_of_stack = __builtin_frame_address(0)
-    PLf("frame address = %p", __builtin_frame_address(0))
-
-    /* As a result of optimization (-fomit-frame-pointer) the frame pointer
-    register (rbp) may be used as a regular register. In this case the frame
-    pointer register may contain a pointer to a managed object and thus has to
-    be scanned. Unfortunately, setjmp mangles rbp for security reasons. Thus it
-    is scanned explicitly. */
-    uint64_t rbp = 0
-    __asm__ ("movq %%rbp, %0" : "=r"(rbp))
-    PLf("rbp = %llx", rbp)
-    if rbp != 0 do
-        Allocation* a = allocation_address(rbp)
-        if is_alloc_aligned(a) && tr_contains(allocations, a) do
-            PLf("found allocation: rbp = %llx, a = %p", rbp, a)
-            mark(a)
+    assert("aligned pointer", top_of_stack != NULL && ((uint64_t)top_of_stack & 7) == 0)
+    assert("running stack", current_stack >= 0)
+    uint64_t* bottom = bottom_of_stack
+    if current_stack != GC_MAIN_STACK do bottom = (uint64_t*)stacks[current_stack].hi
+    assert_not_null(bottom)
+    PLf("bottom_of_stack = %p", bottom)
+    PLf("top_of_stack    = %p %ld", top_of_stack, bottom - top_of_stack)
+    assert("stack grows down", top_of_stack < bottom)
+    mark_stack_cached(top_of_stack, bottom)
 
+/*
+Saves the registers in its own stack frame, then scans the running stack from
+below that frame. The registers are saved before any other work is done, so
+that no callee-saved register of a caller has been overwritten yet. A register
+that the prologue of mark_registers saves and then reuses is in the frame of
+mark_registers as well. Thus registers are not marked individually, they are
+scanned as part of the stack.
+*/
+void __attribute__((noinline)) mark_registers(void)
     /* https://en.wikipedia.org/wiki/Setjmp.h
     /Applications/Xcode.app/Contents/Developer/Platforms/MacOSX.platform/Developer/SDKs/MacOSX.sdk/usr/include/setjmp.h
     Registers may contain pointers to managed objects. On x86-64/macOS setjmp
@@ -355,59 +2545,213 @@ uint64_t* __attribute__((noinline)) mark_registers(void)
     client code (outside this gc). The stack frames of client code need to be
     scanned completely, up to the bottom of the stack. */
     jmp_buf buf // 148 bytes for x86-64/macOS
-    assert("aligned buf", ((uint64_t)&buf & 7) == 0)
-    memset(&buf, 0, sizeof(jmp_buf))
+    memset(&buf, 0, sizeof(jmp_buf)) // no stale words in the unused parts
     setjmp(buf) // save the contents of callee-saved registers
-    uint64_t* p = (uint64_t*)buf
-    uint64_t* q = p + sizeof(jmp_buf) / sizeof(uint64_t)
-    for ; p < q; p++ do
-        if *p != 0 do
-            Allocation* a = allocation_address(*p)
-            if is_alloc_aligned(a) && tr_contains(allocations, a) do
-                PLf("found allocation: p = %p, a = %p", p, a)
-                mark(a)
-    ensure("aligned pointer", top_of_stack != NULL && ((uint64_t)top_of_stack & 7) == 0)
-    return top_of_stack
-
-// Scan the stack for pointers to allocations.
+
+    /* As a result of optimization (-fomit-frame-pointer) the frame pointer
+    register (rbp) may be used as a regular register. In this case the frame
+    pointer register may contain a pointer to a managed object and thus has to
+    be scanned. Unfortunately, setjmp mangles rbp for security reasons. Thus it
+    is stored explicitly. */
+    volatile uint64_t rbp = 0
+    __asm__ ("movq %%rbp, %0" : "=r"(rbp))
+    PLf("rbp = %llx", rbp)
+
+    mark_running_stack()
+    __asm__ volatile ("" : : "r"(&buf), "r"(&rbp) : "memory") // keep buf and rbp until scanned
+
+// Scans the running stack and the suspended stacks for pointers to managed objects.
 void mark_stack(void)
     PLf("frame address = %p", __builtin_frame_address(0))
-    uint64_t* top_of_stack = mark_registers()
-    assert_not_null(bottom_of_stack)
-    PLf("bottom_of_stack = %p", bottom_of_stack)
-    PLf("top_of_stack    = %p %ld", top_of_stack, bottom_of_stack - top_of_stack)
-    assert("stack grows down", top_of_stack < bottom_of_stack)
-    for uint64_t* p = top_of_stack; p < bottom_of_stack; p++ do
-        // PLf("p = %p", p)
-        // is the value on the stack at address p a valid allocation?
-        // if so, the stack contains the user part, need to subtract
-        // offset of object in Allocation
-        if *p != 0 do
-            Allocation* a = allocation_address(*p)
-            if is_alloc_aligned(a) && tr_contains(allocations, a) do 
-                PLf("found allocation: p = %p, a = %p", p, a)
-                mark(a)
+    mark_registers()
+    mark_suspended_stacks()
+
+// Marks the objects that the pointers of the shadow stack point to.
+void mark_shadow_stack(void)
+    PLf("shadow_stack_count = %d", shadow_stack_count)
+    for int i = 0; i < shadow_stack_count; i++ do
+        mark_conservative((uint64_t)*shadow_stack[i])
+
+// Removes all values from a trie.
+bool f_remove(uint64_t x, void* context)
+    return false // remove
+
+// Starts a new blacklist. The pages found in the last collection stay blacklisted.
+void age_blacklist(void)
+    trie_visit(&blacklist, f_remove, NULL)
+    blacklist = blacklist_next
+    blacklist_next = 0
 
 /*
-Called when it is necessary to collect garbage. The stack is automatically
-searched for pointers to garbage-collected memory. Moreover, objects that have
-explicitly been added as root objects are also scanned. This function may also
-be called manually by clients.
+Marks the values of marked ephemerons whose keys are marked. Marking a value may
+mark further keys, so this is repeated until no more values get marked.
 */
-*void gc_collect(void)
+void mark_ephemerons(void)
+    bool progress = true
+    while progress do
+        progress = false
+        for int i = 0; i < ephemerons_count; i++ do
+            Ephemeron* e = ephemerons[i]
+            char* v = e->value
+            if v == NULL || !object_is_marked((char*)e, page_of(e)) do continue
+            if !object_is_marked(e->key, page_of(e->key)) || object_is_marked(v, page_of(v)) do continue
+            mark(v, page_of(v))
+            progress = true
+
+/*
+Moves the finalizers of unmarked objects to the finalization queue. Then marks
+the queued objects, so that they and the objects they refer to stay alive until
+their finalizers have run.
+*/
+void queue_finalizers(void)
+    int n = 0
+    int queued = queue_count
+    for int i = 0; i < finalizers_count; i++ do
+        Finalizer f = finalizers[i]
+        if object_is_marked(f.o, page_of(f.o)) do
+            finalizers[n++] = f
+        else
+            finalization_queue = append_finalizer(finalization_queue, &queue_count, &queue_capacity, f)
+    finalizers_count = n
+    for int i = queued; i < queue_count; i++ do
+        char* o = finalization_queue[i].o
+        mark(o, page_of(o))
+
+/*
+Clears the marked ephemerons whose keys are unmarked. Removes the cleared and
+the unmarked ephemerons from the table of all ephemerons.
+*/
+void clear_ephemerons(void)
+    int n = 0
+    for int i = 0; i < ephemerons_count; i++ do
+        Ephemeron* e = ephemerons[i]
+        if !object_is_marked((char*)e, page_of(e)) do continue // garbage itself
+        if !object_is_marked(e->key, page_of(e->key)) do
+            e->key = NULL
+            e->value = NULL
+            continue
+        ephemerons[n++] = e
+    ephemerons_count = n
+
+/*
+Clears the weak references to unmarked objects. Called after marking and before
+the finalizers are queued, so that a weak reference never returns an object that
+is about to be finalized.
+*/
+void clear_weak_refs(void)
+    for int i = 0; i < weak_refs_count; i++ do
+        void** r = weak_refs[i]
+        char* o = *r
+        if o != NULL && !object_is_marked(o, page_of(o)) do *r = NULL
+
+/*
+Removes the unmarked weak references from the table. Called after the queued
+objects have been marked, which may have resurrected weak references.
+*/
+void remove_weak_refs(void)
+    int n = 0
+    for int i = 0; i < weak_refs_count; i++ do
+        void** r = weak_refs[i]
+        if object_is_marked((char*)r, page_of(r)) do weak_refs[n++] = r
+    weak_refs_count = n
+
+/*
+Cost model of a collection: the duration is estimated as proportional to the
+heap size (at least COST_HEAP_MIN), the factor is an exponential moving average
+over the previous collections. Until the first collection, 1 ns per byte is
+assumed.
+*/
+double collection_ns_per_byte = 1.0
+#define COST_HEAP_MIN (1024 * 1024)
+
+// Returns the estimated duration of a collection of a heap of the given size in nanoseconds.
+uint64_t collection_cost_ns(uint64_t heap)
+    if heap < COST_HEAP_MIN do heap = COST_HEAP_MIN
+    return (uint64_t)(collection_ns_per_byte * heap)
+
+// Updates the cost model with the duration of a collection of a heap of the given size.
+void update_collection_cost(uint64_t heap, uint64_t ns)
+    if heap < COST_HEAP_MIN do heap = COST_HEAP_MIN
+    double sample = (double)ns / heap
+    collection_ns_per_byte = collections_count <= 1 ? sample : 0.75 * collection_ns_per_byte + 0.25 * sample
+
+void __attribute__((noinline)) collect(void)
     PLf("frame address = %p", __builtin_frame_address(0))
     PLf("cc = %llu, ac = %llu, ct = %llu, st = %llu\n", collections_count, allocations_count, count_threshold, size_threshold)
-    mark_stack()
+    uint64_t start_ns = now_ns()
+    uint64_t heap = heap_size()
+    flush_allocation_log()
+    age_blacklist()
+    if precise_stack do
+        mark_shadow_stack()
+    else
+        mark_stack()
     mark_roots()
+    mark_ephemerons()
+    clear_weak_refs()
+    queue_finalizers()
+    mark_ephemerons() // resurrected objects may be keys
+    clear_ephemerons()
+    remove_weak_refs()
     // PL; print_allocations()
     sweep()
     // PL; print_allocations()
     collections_count++
-    //time_since_collection = 0
-    count_threshold = 2 * allocations_count
-    if count_threshold < COUNT_THRESHOLD_MIN do count_threshold = COUNT_THRESHOLD_MIN
-    size_threshold = 2 * allocations_size
-    if size_threshold < SIZE_THRESHOLD_MIN do size_threshold = SIZE_THRESHOLD_MIN
+    fresh_lo = UINT64_MAX
+    fresh_hi = 0
+    set_thresholds()
+    update_collection_cost(heap, now_ns() - start_ns)
+
+/*
+Zeroes a part of the stack below the caller's frame. Frames that are created
+afterwards may have slots that are never written (e.g. padding). Such slots
+would otherwise contain stale pointers from earlier calls, which the stack scan
+would take for live references. Thus the stack is cleared before the frames of
+the collector are created.
+*/
+void __attribute__((noinline)) clear_stack(void)
+    char buf[2048]
+    memset(buf, 0, sizeof(buf))
+    __asm__ volatile ("" : : "r"(buf) : "memory") // keep the memset
+
+/*
+Called when it is necessary to collect garbage. The stack is automatically
+searched for pointers to garbage-collected memory (in precise mode only the
+pointers that are registered in the shadow stack). Moreover, objects that have
+explicitly been added as root objects are also scanned. This function may also
+be called manually by clients.
+*/
+*void gc_collect(void)
+    clear_stack()
+    collect()
+
+// Results of gc_collect_idle.
+*#define GC_IDLE_COLLECTED 0 // a collection has been done
+*#define GC_IDLE_NOT_NEEDED 1 // the heap has not grown enough to be worth collecting
+*#define GC_IDLE_NO_TIME 2 // a collection would not finish before the deadline
+
+/*
+Uses idle time until the deadline (in nanoseconds of CLOCK_MONOTONIC) for
+collection work. The allocation log is sorted into the allocations table and
+the dirty pages that have decayed are purged. Then a collection is done, if the
+heap has grown by at least a quarter of the way to the next triggered
+collection and the estimated duration of the collection (see
+collection_cost_ns) fits before the deadline. Collections are not incremental,
+so a collection is either done completely or not started. Does nothing in a
+no-GC region.
+*/
+*int gc_collect_idle(uint64_t deadline_ns)
+    if no_gc_region do return GC_IDLE_NOT_NEEDED // keep the reserved pages
+    flush_allocation_log()
+    purge_dirty_pages(now_ms())
+    uint64_t heap = heap_size()
+    uint64_t grown = heap > live_heap ? heap - live_heap : 0
+    uint64_t growth = size_threshold > live_heap ? size_threshold - live_heap : 0
+    if grown < growth / 4 do return GC_IDLE_NOT_NEEDED
+    uint64_t now = now_ns()
+    if now >= deadline_ns || deadline_ns - now < collection_cost_ns(heap) do return GC_IDLE_NO_TIME
+    gc_collect()
+    return GC_IDLE_COLLECTED
 
 void test_alignment(void)
     // test address alignment on the stack
@@ -8,11 +8,14 @@
 // #define NO_REQUIRE
 // #define NO_ENSURE
 
+#define _POSIX_C_SOURCE 200809L // mkdtemp
 #include <time.h>
 #include <errno.h>
+#include <unistd.h>
 #include <sys/resource.h>
 #include "util.h"
 #include "gc.h"
+#include "gc_trace.h"
 
 /*
 Allocate a C string. A string is an object without pointers to managed memory.
@@ -335,6 +338,1060 @@ void __attribute__((noinline)) test4(void)
     test_freed_count += freed_count
     test_equal_i(tree3_count(t), 6)
 
+/*
+Small objects are allocated in cells of pages without allocation headers. Checks
+that cells of different sizes and types do not overlap, that they are zeroed on
+allocation, and that cells referenced from the stack survive collections.
+*/
+#define SMALL_COUNT 100
+void __attribute__((noinline)) test5(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    char* strs[SMALL_COUNT]
+    Node* nodes[SMALL_COUNT]
+    char s[SMALL_COUNT + 1]
+    for int i = 0; i < SMALL_COUNT; i++ do
+        memset(s, 'a' + i % 26, i + 1)
+        s[i + 1] = '\0'
+        strs[i] = new_str(s)
+        Node* n = gc_alloc_object(node_type)
+        assert("zeroed", n->i == 0 && n->left == NULL && n->right == NULL)
+        n->i = i
+        n->left = i > 0 ? nodes[i - 1] : NULL
+        nodes[i] = n
+        // garbage in between
+        new_str(s)
+        leaf(i)
+    gc_collect()
+    gc_collect()
+    for int i = 0; i < SMALL_COUNT; i++ do
+        assert("same length", strlen(strs[i]) == i + 1)
+        assert("same content", strs[i][0] == 'a' + i % 26 && strs[i][i] == 'a' + i % 26)
+        assert("same node", nodes[i]->i == i)
+    test_equal_i(tree_count(nodes[SMALL_COUNT - 1]), SMALL_COUNT)
+    nodes[SMALL_COUNT - 1]->left = NULL
+    for int i = 0; i < SMALL_COUNT - 1; i++ do nodes[i] = NULL
+    gc_collect()
+    test_equal_i(tree_count(nodes[SMALL_COUNT - 1]), 1)
+
+/*
+Large arrays and blobs are mapped individually. A pointer into the middle of a
+large object keeps it alive.
+*/
+#define LARGE_COUNT 10000
+void __attribute__((noinline)) test6(void)
+    if a_type == 0 do
+        a_type = make_a_type()
+        printf("a_type = %d\n", a_type)
+    if b_type == 0 do
+        b_type = make_b_type()
+        printf("b_type = %d\n", b_type)
+    B* bs = gc_alloc_array(b_type, LARGE_COUNT)
+    for int i = 0; i < LARGE_COUNT; i++ do
+        assert("zeroed", bs[i].j == 0 && bs[i].a == NULL)
+        bs[i].j = i
+        bs[i].a = new_a(i, "large", "object")
+    char* blob = gc_alloc(1024 * 1024)
+    blob[1024 * 1024 - 1] = 'x'
+    gc_collect()
+    for int i = 0; i < LARGE_COUNT; i++ do
+        assert("survived", bs[i].j == i && bs[i].a->i == i && strcmp(bs[i].a->t, "object") == 0)
+    test_equal_i(blob[1024 * 1024 - 1], 'x')
+    B* middle = bs + LARGE_COUNT / 2
+    bs = NULL
+    gc_collect()
+    test_equal_i(middle[-LARGE_COUNT / 2].a->i, 0)
+    test_equal_i(middle[LARGE_COUNT / 2 - 1].a->i, LARGE_COUNT - 1)
+    gc_print_stats()
+
+/*
+Pages that become empty are purged after the decay time. With a decay time of 0
+the memory of the emptied pages is returned to the operating system at the end
+of the collection that empties them.
+*/
+#define PURGE_COUNT 200000
+void __attribute__((noinline)) make_garbage(void)
+    Node* t = NULL
+    for int i = 0; i < PURGE_COUNT; i++ do t = node(i, t, NULL)
+    int n = 0
+    for ; t != NULL; t = t->left do n++
+    test_equal_i(n, PURGE_COUNT)
+
+void __attribute__((noinline)) test7(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    gc_set_dirty_decay_ms(0)
+    make_garbage()
+    uint64_t resident = gc_resident_bytes()
+    gc_collect()
+    uint64_t purged = gc_resident_bytes()
+    printf("resident before: %llu, after: %llu, mapped: %llu\n", resident, purged, gc_mapped_bytes())
+    assert("memory returned", purged + PURGE_COUNT * sizeof(Node) <= resident)
+    assert("still mapped", gc_mapped_bytes() >= resident)
+    gc_print_stats()
+    gc_set_dirty_decay_ms(1000)
+
+/*
+In precise mode only the pointers registered in the shadow stack are roots.
+Unregistered locals do not keep objects alive. Frames are popped when their
+scope is left.
+*/
+Node* __attribute__((noinline)) make_list(int n)
+    GC_FRAME
+    Node* t = NULL
+    GC_LOCAL(t)
+    for int i = 0; i < n; i++ do
+        t = node(i, t, NULL)
+        if i % 100 == 0 do gc_collect()
+    return t
+
+void __attribute__((noinline)) test8(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    gc_set_precise_stack(true)
+    GC_FRAME
+    Node* kept = NULL
+    GC_LOCAL(kept)
+    kept = make_list(1000)
+    int n = 0
+    for Node* t = kept; t != NULL; t = t->left do n++
+    test_equal_i(n, 1000)
+    Node* lost = leaf(-1) // not registered
+    assert("not null", lost != NULL)
+    kept = NULL
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    gc_set_precise_stack(false)
+
+/*
+Handles keep objects alive until they are freed. Freed handles are reused.
+*/
+#define HANDLE_COUNT 1000
+gc_handle_t hs[HANDLE_COUNT]
+void __attribute__((noinline)) make_handles(void)
+    for int i = 0; i < HANDLE_COUNT; i++ do hs[i] = gc_new_handle(leaf(i))
+
+void __attribute__((noinline)) test9(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    make_handles()
+    for int i = 0; i < HANDLE_COUNT; i += 2 do gc_free_handle(hs[i])
+    gc_collect()
+    for int i = 1; i < HANDLE_COUNT; i += 2 do
+        Node* n = gc_handle_get(hs[i])
+        assert("survived", n->i == i)
+    gc_handle_t h = gc_new_handle(NULL)
+    test_equal_i(h, hs[HANDLE_COUNT - 2]) // most recently freed
+    gc_handle_set(h, gc_handle_get(hs[1]))
+    gc_free_handle(hs[1])
+    gc_collect()
+    test_equal_i(((Node*)gc_handle_get(h))->i, 1)
+    gc_free_handle(h)
+    for int i = 3; i < HANDLE_COUNT; i += 2 do gc_free_handle(hs[i])
+
+/*
+Root ranges keep the objects alive that global memory points to. Untyped ranges
+are scanned conservatively, typed ranges only at the pointer offsets of the type.
+*/
+#define RANGE_COUNT 100
+Node* global_nodes[RANGE_COUNT]
+A global_as[RANGE_COUNT]
+
+void __attribute__((noinline)) fill_globals(void)
+    for int i = 0; i < RANGE_COUNT; i++ do
+        global_nodes[i] = leaf(i)
+        global_as[i].i = i
+        global_as[i].t = new_str("global")
+
+void __attribute__((noinline)) test10(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    if a_type == 0 do
+        a_type = make_a_type()
+        printf("a_type = %d\n", a_type)
+    gc_add_root_range(global_nodes, sizeof(global_nodes))
+    gc_add_typed_root_range(global_as, a_type, RANGE_COUNT)
+    fill_globals()
+    gc_collect()
+    gc_collect()
+    for int i = 0; i < RANGE_COUNT; i++ do
+        assert("survived", global_nodes[i]->i == i)
+        assert("survived", strcmp(global_as[i].t, "global") == 0)
+    gc_remove_root_range(global_nodes)
+    gc_remove_root_range(global_as)
+    memset(global_nodes, 0, sizeof(global_nodes))
+    memset(global_as, 0, sizeof(global_as))
+
+/*
+With data segment scanning, objects that are only referenced from global
+variables survive without being registered.
+*/
+Node* unregistered_global = NULL
+void __attribute__((noinline)) set_unregistered_global(void)
+    unregistered_global = node(42, leaf(1), leaf(2))
+
+void __attribute__((noinline)) test11(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    gc_set_scan_data_segments(true)
+    set_unregistered_global()
+    gc_collect()
+    gc_collect()
+    test_equal_i(unregistered_global->i, 42)
+    test_equal_i(tree_count(unregistered_global), 3)
+    unregistered_global = NULL
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    gc_set_scan_data_segments(false)
+
+/*
+Measures false retention. Integers that happen to look like addresses of cells
+in unused pages are registered as a conservatively scanned root range. Then a
+long list is allocated and dropped. Without blacklisting, the list reuses those
+pages and the integers retain parts of it. With blacklisting, the pages are
+avoided for cells that contain pointers.
+*/
+#define NOISE_COUNT 64
+#define CHAIN_COUNT 100000
+uint64_t noise[NOISE_COUNT]
+
+void __attribute__((noinline)) make_noise(void)
+    Node* t = NULL
+    for int i = 0; i < CHAIN_COUNT; i++ do
+        t = node(i, t, NULL)
+        // every 1000th node: an integer value that equals its address
+        if i % (CHAIN_COUNT / NOISE_COUNT) == 0 && i / (CHAIN_COUNT / NOISE_COUNT) < NOISE_COUNT do
+            noise[i / (CHAIN_COUNT / NOISE_COUNT)] = (uint64_t)t
+    t = NULL
+
+void __attribute__((noinline)) make_chain(void)
+    Node* t = NULL
+    for int i = 0; i < CHAIN_COUNT; i++ do t = node(i, t, NULL)
+    t = NULL
+
+uint64_t __attribute__((noinline)) false_retention(bool blacklisting)
+    gc_set_blacklisting(blacklisting)
+    gc_set_dirty_decay_ms(-1) // keep the pages of the noise
+    make_noise()
+    gc_collect() // the noise now points into unused pages
+    gc_add_root_range(noise, sizeof(noise))
+    gc_collect() // finds the noise
+    make_chain()
+    gc_collect()
+    uint64_t retained = gc_allocated_bytes()
+    gc_remove_root_range(noise)
+    memset(noise, 0, sizeof(noise))
+    gc_collect()
+    gc_collect()
+    gc_set_dirty_decay_ms(1000)
+    gc_set_blacklisting(true)
+    return retained
+
+void __attribute__((noinline)) test12(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    uint64_t without = false_retention(false)
+    uint64_t with = false_retention(true)
+    printf("false retention: %llu bytes without blacklisting, %llu bytes with blacklisting\n", without, with)
+    assert("less false retention", with < without)
+    test_equal_i(with, 0)
+
+/*
+Pointers into the middle of objects keep the objects alive: an element pointer
+into an array with allocation header and a pointer into a cell.
+*/
+#define INTERIOR_COUNT 100
+B* __attribute__((noinline)) make_array(void)
+    B* bs = gc_alloc_array(b_type, INTERIOR_COUNT)
+    for int i = 0; i < INTERIOR_COUNT; i++ do
+        bs[i].j = i
+        bs[i].a = new_a(i, "interior", "pointer")
+    return bs + INTERIOR_COUNT / 2
+
+char* __attribute__((noinline)) make_interior_string(void)
+    return new_str("interior pointer") + 9
+
+void __attribute__((noinline)) test13(void)
+    if a_type == 0 do
+        a_type = make_a_type()
+        printf("a_type = %d\n", a_type)
+    if b_type == 0 do
+        b_type = make_b_type()
+        printf("b_type = %d\n", b_type)
+    B* middle = make_array()
+    char* s = make_interior_string()
+    gc_collect()
+    gc_collect()
+    for int i = -INTERIOR_COUNT / 2; i < INTERIOR_COUNT / 2; i++ do
+        assert("survived", middle[i].j == i + INTERIOR_COUNT / 2)
+        assert("survived", strcmp(middle[i].a->t, "pointer") == 0)
+    test_equal_i(strcmp(s - 9, "interior pointer"), 0)
+
+/*
+Suspended coroutine stacks are scanned from their saved stack pointer to their
+high end, the unused part below the stack pointer is not scanned. The saved
+register context is scanned. Simulated with stack memory that is filled by hand.
+*/
+#define STACK_WORDS 64
+#define STACKS_COUNT 100000
+void* fake_stack[STACK_WORDS]
+void* fake_context[4]
+
+void __attribute__((noinline)) fill_fake_stack(void)
+    fake_stack[STACK_WORDS - 1] = leaf(1) // used region
+    fake_stack[STACK_WORDS / 2] = leaf(2) // used region
+    fake_stack[STACK_WORDS / 2 - 1] = leaf(3) // unused region
+    fake_context[1] = leaf(4)
+
+void __attribute__((noinline)) test14(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    gc_stack_t h = gc_register_stack(fake_stack, fake_stack + STACK_WORDS)
+    fill_fake_stack()
+    // switch from the main stack to the coroutine and back
+    gc_suspend_stack(GC_MAIN_STACK, __builtin_frame_address(0), NULL, 0)
+    gc_resume_stack(h)
+    gc_suspend_stack(h, fake_stack + STACK_WORDS / 2, fake_context, sizeof(fake_context))
+    gc_resume_stack(GC_MAIN_STACK)
+    gc_collect()
+    gc_collect()
+    test_equal_i(((Node*)fake_stack[STACK_WORDS - 1])->i, 1)
+    test_equal_i(((Node*)fake_stack[STACK_WORDS / 2])->i, 2)
+    test_equal_i(((Node*)fake_context[1])->i, 4)
+    test_equal_i(gc_allocated_bytes(), 3 * sizeof(Node)) // leaf 3 is freed
+    fake_stack[STACK_WORDS / 2 - 1] = NULL // freed, do not keep a dangling pointer
+    gc_unregister_stack(h)
+    memset(fake_stack, 0, sizeof(fake_stack))
+    memset(fake_context, 0, sizeof(fake_context))
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+
+    // many small suspended stacks
+    void** memory = xcalloc(STACKS_COUNT, 4 * sizeof(void*))
+    gc_stack_t* hs = xmalloc(STACKS_COUNT * sizeof(gc_stack_t))
+    clock_t time = clock()
+    for int i = 0; i < STACKS_COUNT; i++ do
+        hs[i] = gc_register_stack(memory + 4 * i, memory + 4 * i + 4)
+    gc_collect()
+    for int i = 0; i < STACKS_COUNT; i++ do gc_unregister_stack(hs[i])
+    time = clock() - time
+    printf("%d stacks: %g ms\n", STACKS_COUNT, time * 1000.0 / CLOCKS_PER_SEC)
+    free(memory)
+    free(hs)
+
+/*
+The stack scan reuses the results of the previous scan for unchanged stack
+words. A word that did not point to an object in the previous scan, but points
+to an object that was allocated since then, has to be found again.
+*/
+uint64_t __attribute__((noinline)) hidden_leaf(int i)
+    return ~(uint64_t)leaf(i)
+
+void __attribute__((noinline)) test15(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    Node* kept = node(1, leaf(2), leaf(3))
+    volatile uint64_t slot = hidden_leaf(4) // garbage, address hidden during the first collection
+    gc_collect()
+    slot = ~slot
+    gc_collect() // the unchanged slot is a miss: its cell has been freed
+    gc_collect() // cached miss
+    // allocate until the freed cell is handed out again, the slot is unchanged
+    Node* n = NULL
+    for int i = 0; i < 100000 && (uint64_t)n != slot; i++ do
+        n = leaf(5)
+    assert("cell reused", (uint64_t)n == slot)
+    n = NULL
+    gc_collect()
+    gc_collect()
+    test_equal_i(((Node*)slot)->i, 5)
+    test_equal_i(tree_count(kept), 3)
+    test_equal_i(kept->left->i + kept->right->i, 5)
+    slot = 0
+
+/*
+Tree has the same layout as Node, but has a generated trace function. Its
+objects are traced via the mark stack instead of by pointer reversal.
+*/
+typedef struct Tree Tree
+struct Tree
+    int i
+    Tree* left // managed
+    Node* right // managed
+
+GC_DEFINE_TYPE(Tree, left, right)
+
+int tree_type = 0
+
+Tree* tree(int i, Tree* left, Node* right)
+    Tree* t = gc_alloc_object(tree_type)
+    t->i = i
+    t->left = left
+    t->right = right
+    return t
+
+#define LIST_LENGTH 1000000
+
+Node* __attribute__((noinline)) make_node_list(int n)
+    Node* list = NULL
+    for int i = 0; i < n; i++ do list = node(i, list, NULL)
+    return list
+
+Tree* __attribute__((noinline)) make_tree_list(int n)
+    Tree* list = NULL
+    for int i = 0; i < n; i++ do list = tree(i, list, NULL)
+    return list
+
+void __attribute__((noinline)) test16(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    if tree_type == 0 do
+        tree_type = Tree_gc_new_type()
+        printf("tree_type = %d\n", tree_type)
+
+    // traced objects and objects with pointer offsets point to each other
+    Node* n = node(1, leaf(2), NULL)
+    n->right = (Node*)tree(3, tree(4, NULL, leaf(5)), node(6, leaf(7), NULL))
+    Tree* t = tree(8, NULL, n)
+    n = NULL
+    gc_collect()
+    test_equal_i(gc_allocated_bytes(), 8 * sizeof(Node))
+    n = t->right
+    test_equal_i(n->left->i + n->i, 3)
+    Tree* t3 = (Tree*)n->right
+    test_equal_i(t3->i + t3->left->i + t3->left->right->i, 12)
+    test_equal_i(t3->right->i + t3->right->left->i, 13)
+    t = NULL; n = NULL; t3 = NULL
+    gc_collect()
+
+    Node* nodes = make_node_list(LIST_LENGTH)
+    clock_t time = clock()
+    gc_collect()
+    time = clock() - time
+    printf("mark %d nodes by pointer reversal: %g ms\n", LIST_LENGTH, time * 1000.0 / CLOCKS_PER_SEC)
+    int count = 0
+    for Node* m = nodes; m != NULL; m = m->left do count++
+    test_equal_i(count, LIST_LENGTH)
+    nodes = NULL
+
+    Tree* trees = make_tree_list(LIST_LENGTH)
+    time = clock()
+    gc_collect()
+    time = clock() - time
+    printf("mark %d trees by trace function: %g ms\n", LIST_LENGTH, time * 1000.0 / CLOCKS_PER_SEC)
+    count = 0
+    for Tree* m = trees; m != NULL; m = m->left do count++
+    test_equal_i(count, LIST_LENGTH)
+    trees = NULL
+
+/*
+Pair has managed pointers in words 1 and 3, described by a bitmap instead of
+pointer offsets.
+*/
+typedef struct Pair Pair
+struct Pair
+    int i
+    Node* first // managed
+    double d
+    Node* second // managed
+
+#define POINTERS_COUNT 1000000
+
+void __attribute__((noinline)) check_pairs(void)
+    int pair_type = gc_new_bitmap_type(sizeof(Pair), 0xa)
+    Pair* pairs = gc_alloc_array(pair_type, 3)
+    for int i = 0; i < 3; i++ do
+        pairs[i].i = i
+        pairs[i].first = leaf(i)
+        pairs[i].second = i == 1 ? NULL : leaf(10 * i)
+        pairs[i].d = 0.5
+    gc_collect()
+    test_equal_i(pairs[0].first->i + pairs[2].first->i + pairs[2].second->i, 22)
+    test_equal_i(gc_allocated_bytes(), 5 * sizeof(Node) + 3 * sizeof(Pair))
+
+void __attribute__((noinline)) test17(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    check_pairs()
+
+    // sparse array of pointers
+    int pointers_type = gc_new_pointer_array_type()
+    Node** nodes = gc_alloc_array(pointers_type, POINTERS_COUNT)
+    for int i = 0; i < POINTERS_COUNT; i += 100 do nodes[i] = leaf(i)
+    clock_t time = clock()
+    gc_collect()
+    time = clock() - time
+    printf("mark array of %d pointers: %g ms\n", POINTERS_COUNT, time * 1000.0 / CLOCKS_PER_SEC)
+    int sum = 0
+    for int i = 0; i < POINTERS_COUNT; i += 100 do sum += nodes[i]->i == i
+    test_equal_i(sum, POINTERS_COUNT / 100)
+    for int i = 0; i < POINTERS_COUNT; i += 200 do nodes[i] = NULL
+    gc_collect()
+    test_equal_i(gc_allocated_bytes(), POINTERS_COUNT / 200 * sizeof(Node) + POINTERS_COUNT * sizeof(Node*))
+    test_equal_i(nodes[100]->i, 100) // keeps the array reachable during the collection
+    nodes = NULL
+
+#define TYPES_COUNT 200
+#define HUGE_COUNT ((1 << 24) + 5)
+#define WIDE_COUNT 300
+
+// More than 127 types, arrays of the last ones need extended headers.
+void __attribute__((noinline)) many_types(void)
+    int type = 0
+    for int i = 0; i < TYPES_COUNT; i++ do
+        type = gc_new_type(sizeof(Node), 2)
+        gc_set_offset(type, 0, offsetof(Node, left))
+        gc_set_offset(type, 1, offsetof(Node, right))
+    test_equal_i(type > 0x7f, true)
+    Node* single = gc_alloc_object(type)
+    single->left = leaf(1)
+    Node* array = gc_alloc_array(type, 3)
+    array[2].right = leaf(2)
+    gc_collect()
+    test_equal_i(single->left->i + array[2].right->i, 3)
+    test_equal_i(gc_allocated_bytes(), 6 * sizeof(Node))
+
+// More than 2^24 elements.
+void __attribute__((noinline)) huge_arrays(void)
+    int pointers_type = gc_new_pointer_array_type()
+    Node** huge = gc_alloc_array(pointers_type, HUGE_COUNT)
+    huge[0] = leaf(3)
+    huge[HUGE_COUNT - 1] = leaf(4)
+    char* bytes = gc_alloc(HUGE_COUNT)
+    bytes[HUGE_COUNT - 1] = 'x'
+    clock_t time = clock()
+    gc_collect()
+    time = clock() - time
+    printf("mark array of %d pointers: %g ms\n", HUGE_COUNT, time * 1000.0 / CLOCKS_PER_SEC)
+    test_equal_i(huge[0]->i + huge[HUGE_COUNT - 1]->i, 7)
+    test_equal_i(bytes[HUGE_COUNT - 1], 'x')
+    test_equal_i(gc_allocated_bytes(), (uint64_t)HUGE_COUNT * sizeof(Node*) + HUGE_COUNT + 2 * sizeof(Node))
+
+// More than 255 pointers per object.
+void __attribute__((noinline)) wide_objects(void)
+    int wide_type = gc_new_type(WIDE_COUNT * sizeof(Node*), WIDE_COUNT)
+    for int j = 0; j < WIDE_COUNT; j++ do gc_set_offset(wide_type, j, j * sizeof(Node*))
+    Node** wide = gc_alloc_array(wide_type, 2)
+    wide[2 * WIDE_COUNT - 1] = leaf(5)
+    Node* holder = node(0, (Node*)wide, NULL)
+    wide = NULL
+    gc_collect()
+    test_equal_i(((Node**)holder->left)[2 * WIDE_COUNT - 1]->i, 5)
+
+void __attribute__((noinline)) test18(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    many_types()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    huge_arrays()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    wide_objects()
+
+/*
+Cells of an interpreter hold tagged values: small integers with the low bit
+set, raw pointers otherwise. Boxes hold NaN-boxed values: doubles or pointers
+with the tag 0xfffc in the upper 16 bits.
+*/
+typedef struct Cell Cell
+struct Cell
+    uint64_t head // tagged value
+    uint64_t tail // tagged value
+
+#define int_value(i) (((uint64_t)(i) << 1) | 1)
+#define NAN_BOX_TAG 0xfffc000000000000ull
+#define NAN_BOX_MASK 0xffff000000000000ull
+#define nan_box(p) ((uint64_t)(p) | NAN_BOX_TAG)
+#define nan_unbox(w) ((void*)((w) & ~NAN_BOX_MASK))
+
+int cell_type = 0
+int box_type = 0
+
+uint64_t __attribute__((noinline)) make_cells(int n)
+    uint64_t list = 0
+    for int i = 0; i < n; i++ do
+        Cell* c = gc_alloc_object(cell_type)
+        c->head = int_value(i)
+        c->tail = list
+        list = (uint64_t)c
+    return list
+
+// Returns a box array whose pointer is only stored NaN-boxed.
+uint64_t* __attribute__((noinline)) make_boxes(void)
+    uint64_t* boxes = gc_alloc_array(box_type, 2)
+    double d = 2.5
+    memcpy(boxes, &d, sizeof(d))
+    boxes[1] = nan_box(leaf(6))
+    return boxes
+
+void __attribute__((noinline)) test19(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    int low_bit = gc_new_tag_scheme(1, 0, ~0ull, 0)
+    int nan_boxing = gc_new_tag_scheme(NAN_BOX_MASK, NAN_BOX_TAG, ~NAN_BOX_MASK, 0)
+    cell_type = gc_new_type(sizeof(Cell), 2)
+    gc_set_tagged_offset(cell_type, 0, offsetof(Cell, head), low_bit)
+    gc_set_tagged_offset(cell_type, 1, offsetof(Cell, tail), low_bit)
+    box_type = gc_new_type(sizeof(uint64_t), 1)
+    gc_set_tagged_offset(box_type, 0, 0, nan_boxing)
+
+    Cell* list = (Cell*)make_cells(1000)
+    uint64_t* boxes = make_boxes()
+    gc_collect()
+    int sum = 0, count = 0
+    for Cell* c = list; c != NULL; c = (Cell*)c->tail do
+        sum += c->head >> 1
+        count++
+    test_equal_i(count, 1000)
+    test_equal_i(sum, 999 * 1000 / 2)
+    test_equal_i(((Node*)nan_unbox(boxes[1]))->i, 6)
+    test_equal_i(gc_allocated_bytes(), 1000 * sizeof(Cell) + 2 * sizeof(uint64_t) + sizeof(Node))
+
+/*
+A cache holds weak references to its entries. Entries that are only reachable
+from the cache are dropped in a collection.
+*/
+#define CACHE_SIZE 100
+void* cache[CACHE_SIZE]
+
+Node* __attribute__((noinline)) fill_cache(void)
+    Node* kept = NULL
+    for int i = 0; i < CACHE_SIZE; i++ do
+        Node* n = leaf(i)
+        cache[i] = gc_alloc_weak_ref(n)
+        if i == 7 do kept = n
+    return kept
+
+void __attribute__((noinline)) test20(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    gc_add_root_range(cache, sizeof(cache))
+    Node* kept = fill_cache()
+    gc_collect()
+    test_equal_i(gc_weak_get(cache[7]) == kept, true)
+    int cleared = 0
+    for int i = 0; i < CACHE_SIZE; i++ do cleared += gc_weak_get(cache[i]) == NULL
+    test_equal_i(cleared, CACHE_SIZE - 1)
+    test_equal_i(gc_allocated_bytes(), CACHE_SIZE * sizeof(void*) + sizeof(Node))
+    kept = NULL
+    gc_remove_root_range(cache)
+    memset(cache, 0, sizeof(cache))
+
+/*
+A memo table maps keys to values that refer back to their keys. Entries whose
+keys are only reachable from their values are dropped in a collection.
+*/
+#define MEMO_SIZE 1000
+Node* memo_keys[MEMO_SIZE]
+void* memo_values[MEMO_SIZE] // weak references to the values
+
+void* __attribute__((noinline)) fill_memo(void)
+    void* memo = gc_new_ephemeron_table()
+    for int i = 0; i < MEMO_SIZE; i++ do
+        Node* key = leaf(i)
+        Node* value = node(-i, key, NULL) // refers to its key
+        gc_ephemeron_put(memo, key, value)
+        memo_values[i] = gc_alloc_weak_ref(value)
+        if i % 2 == 0 do memo_keys[i] = key
+    return memo
+
+void __attribute__((noinline)) test21(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    gc_add_root_range(memo_keys, sizeof(memo_keys))
+    gc_add_root_range(memo_values, sizeof(memo_values))
+    void* memo = fill_memo()
+    gc_collect()
+    int found = 0, cleared = 0
+    for int i = 0; i < MEMO_SIZE; i++ do
+        if memo_keys[i] != NULL do
+            Node* value = gc_ephemeron_get(memo, memo_keys[i])
+            found += value != NULL && value->i == -i && value->left == memo_keys[i]
+        else
+            cleared += gc_weak_get(memo_values[i]) == NULL
+    test_equal_i(found, MEMO_SIZE / 2)
+    test_equal_i(cleared, MEMO_SIZE / 2)
+    memo = NULL
+    gc_remove_root_range(memo_keys)
+    gc_remove_root_range(memo_values)
+    memset(memo_keys, 0, sizeof(memo_keys))
+    memset(memo_values, 0, sizeof(memo_values))
+
+/*
+A resource wraps a native resource that is released by a finalizer. The
+finalizer may access the objects that the resource refers to. Weak references to
+a resource are cleared when its finalizer is queued, so a closed resource cannot
+be reached through them.
+*/
+#define RESOURCES_COUNT 100
+int closed_count = 0
+int closed_sum = 0
+void* resource_refs[RESOURCES_COUNT]
+
+void close_resource(void* o)
+    Node* r = o
+    closed_count++
+    closed_sum += r->left->i
+
+void __attribute__((noinline)) open_resources(void)
+    for int i = 0; i < RESOURCES_COUNT; i++ do
+        Node* r = node(0, leaf(i), NULL)
+        gc_register_finalizer(r, close_resource)
+        resource_refs[i] = gc_alloc_weak_ref(r)
+
+void __attribute__((noinline)) test22(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    gc_add_root_range(resource_refs, sizeof(resource_refs))
+    open_resources()
+    gc_collect() // queues the finalizers, the resources stay alive
+    test_equal_i(closed_count, 0)
+    test_equal_i(gc_allocated_bytes(), RESOURCES_COUNT * (2 * sizeof(Node) + sizeof(void*)))
+    for int i = 0; i < RESOURCES_COUNT; i++ do
+        test_equal_i(gc_weak_get(resource_refs[i]) == NULL, true)
+    test_equal_i(gc_run_finalizers(), RESOURCES_COUNT)
+    test_equal_i(closed_count, RESOURCES_COUNT)
+    test_equal_i(closed_sum, (RESOURCES_COUNT - 1) * RESOURCES_COUNT / 2)
+    test_equal_i(gc_run_finalizers(), 0)
+    gc_remove_root_range(resource_refs)
+    memset(resource_refs, 0, sizeof(resource_refs))
+    gc_collect() // frees the finalized resources
+    test_equal_i(gc_allocated_bytes(), 0)
+    gc_collect()
+    test_equal_i(closed_count, RESOURCES_COUNT) // finalizers run at most once
+
+#define GARBAGE_COUNT 20000
+#define LIVE_BYTES (20 * 1024 * 1024)
+#define EXTERNAL_BYTES (32 * 1024 * 1024)
+
+// Allocates garbage of count * 1000 bytes.
+void __attribute__((noinline)) make_bytes(int count)
+    for int i = 0; i < count; i++ do gc_alloc(1000)
+
+void __attribute__((noinline)) test23(void)
+    // soft limit: 20 MB of garbage with a 4 MB limit
+    gc_set_soft_limit(4 * 1024 * 1024)
+    gc_collect()
+    uint64_t collections = gc_collections_count()
+    make_bytes(GARBAGE_COUNT)
+    test_equal_i(gc_collections_count() - collections >= 4, true)
+    gc_set_soft_limit(0)
+
+    // external bytes count toward the heap size
+    gc_collect()
+    collections = gc_collections_count()
+    gc_add_external_bytes(64 * 1024 * 1024)
+    test_equal_i(gc_collections_count() - collections, 1)
+    gc_add_external_bytes(-64 * 1024 * 1024)
+
+    // smaller growth: more collections for the same allocations
+    gc_set_growth_percent(10)
+    gc_collect()
+    collections = gc_collections_count()
+    make_bytes(GARBAGE_COUNT)
+    test_equal_i(gc_collections_count() - collections >= 1, true)
+    gc_set_growth_percent(100)
+
+    // the size threshold is the live size plus the growth percentage (above the minimum)
+    gc_set_cgroup_path(NULL) // no adjustment to the memory limit of the host
+    gc_handle_t h = gc_new_handle(gc_alloc(LIVE_BYTES))
+    int percents[] = {10, 50, 100, 200}
+    for int i = 0; i < 4; i++ do
+        gc_set_growth_percent(percents[i])
+        gc_collect()
+        test_equal_i(gc_allocated_bytes(), LIVE_BYTES)
+        test_equal_i(gc_size_threshold(), LIVE_BYTES + (uint64_t)LIVE_BYTES * percents[i] / 100)
+    gc_set_growth_percent(100)
+
+    // a soft limit below the heap leaves 1/16 of the live size as headroom, external bytes excluded
+    gc_set_soft_limit(1024 * 1024)
+    gc_add_external_bytes(EXTERNAL_BYTES)
+    gc_collect()
+    test_equal_i(gc_size_threshold(), LIVE_BYTES + EXTERNAL_BYTES + LIVE_BYTES / 16)
+    gc_add_external_bytes(-EXTERNAL_BYTES)
+    gc_set_soft_limit(0)
+    gc_free_handle(h)
+
+    // time trigger: collects although the thresholds are not reached
+    gc_collect()
+    gc_set_collection_interval_ms(1)
+    collections = gc_collections_count()
+    clock_t time = clock()
+    while gc_collections_count() == collections && clock() - time < CLOCKS_PER_SEC do
+        make_bytes(100)
+    test_equal_i(gc_collections_count() > collections, true)
+    gc_set_collection_interval_ms(0)
+
+/*
+A fake cgroup directory with the given memory limit and usage (in MB) and no
+memory pressure.
+*/
+char cgroup_dir[] = "/tmp/gc_cgroup_XXXXXX"
+
+void write_cgroup_file(char* name, uint64_t value)
+    char path[64]
+    snprintf(path, sizeof(path), "%s/%s", cgroup_dir, name)
+    FILE* f = fopen(path, "w")
+    assert("file opened", f != NULL)
+    fprintf(f, "%llu\n", (unsigned long long)value)
+    fclose(f)
+
+void set_cgroup_memory(uint64_t max_mb, uint64_t current_mb)
+    write_cgroup_file("memory.max", max_mb * 1024 * 1024)
+    write_cgroup_file("memory.current", current_mb * 1024 * 1024)
+
+#define MB (1024 * 1024)
+#define LIVE_MB 20
+
+void __attribute__((noinline)) keep_megabytes(void** kept)
+    for int i = 0; i < LIVE_MB; i++ do kept[i] = gc_alloc(MB)
+
+void __attribute__((noinline)) test24(void)
+    char* dir = mkdtemp(cgroup_dir)
+    assert("directory created", dir != NULL)
+    gc_set_cgroup_path(cgroup_dir)
+
+    // near the limit: 4 MB headroom, collect at least every 2 MB
+    set_cgroup_memory(64, 60)
+    gc_collect()
+    uint64_t collections = gc_collections_count()
+    make_bytes(GARBAGE_COUNT)
+    test_equal_i(gc_collections_count() - collections >= 8, true)
+
+    // far below the limit: the growth is doubled
+    set_cgroup_memory(1024, 1)
+    void* kept[LIVE_MB]
+    gc_add_root_range(kept, sizeof(kept))
+    keep_megabytes(kept)
+    gc_collect()
+    collections = gc_collections_count()
+    make_bytes(30 * MB / 1000) // more than the default growth of 20 MB
+    test_equal_i(gc_collections_count(), collections)
+    gc_remove_root_range(kept)
+
+    gc_set_cgroup_path(NULL)
+    char path[64]
+    snprintf(path, sizeof(path), "%s/memory.max", cgroup_dir)
+    remove(path)
+    snprintf(path, sizeof(path), "%s/memory.current", cgroup_dir)
+    remove(path)
+    rmdir(cgroup_dir)
+
+// Allocates cells of three page lists until the budget (in bytes) is used up.
+void __attribute__((noinline)) fill_budget(uint64_t budget)
+    uint64_t end = gc_allocated_bytes() + budget - 256 // 256: largest cell size
+    for int i = 0; gc_allocated_bytes() <= end; i++ do
+        if i % 3 == 0 do leaf(i)
+        else if i % 3 == 1 do gc_alloc(200)
+        else gc_alloc(8)
+
+void __attribute__((noinline)) test25(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    // within the budget
+    uint64_t collections = gc_collections_count()
+    test_equal_i(gc_begin_no_gc_region(MB), true)
+    for int i = 0; i < 1000; i++ do leaf(i)
+    test_equal_i(gc_end_no_gc_region(), true)
+    test_equal_i(gc_collections_count(), collections)
+
+    // budget exceeded, still no collection
+    test_equal_i(gc_begin_no_gc_region(MB), true)
+    collections = gc_collections_count()
+    make_bytes(30 * MB / 1000) // more than the size threshold
+    test_equal_i(gc_collections_count(), collections)
+    test_equal_i(gc_end_no_gc_region(), false)
+    gc_collect()
+
+    // a collection in the region frees garbage allocated before it
+    for int i = 0; i < 1000; i++ do leaf(i)
+    test_equal_i(gc_begin_no_gc_region(MB), true)
+    gc_collect()
+    leaf(0)
+    test_equal_i(gc_end_no_gc_region(), true)
+
+    // the full budget neither maps nor faults in pages
+    gc_set_dirty_decay_ms(0) // no dirty pages left over from before
+    gc_set_dirty_decay_ms(1000)
+    test_equal_i(gc_begin_no_gc_region(32 * MB), true)
+    uint64_t mapped = gc_mapped_bytes()
+    uint64_t resident = gc_resident_bytes()
+    fill_budget(32 * MB)
+    test_equal_i(gc_end_no_gc_region(), true)
+    test_equal_i(gc_mapped_bytes(), mapped)
+    test_equal_i(gc_resident_bytes(), resident)
+    gc_collect()
+
+    // latency of allocations in a region
+    test_equal_i(gc_begin_no_gc_region(8 * MB), true)
+    clock_t time = clock()
+    for int i = 0; i < 8 * MB / sizeof(Node); i++ do leaf(i)
+    time = clock() - time
+    test_equal_i(gc_end_no_gc_region(), true)
+    printf("%d allocations in a no-GC region: %g ms\n", (int)(8 * MB / sizeof(Node)), time * 1000.0 / CLOCKS_PER_SEC)
+
+uint64_t monotonic_ns(void)
+    struct timespec ts
+    clock_gettime(CLOCK_MONOTONIC, &ts)
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec
+
+void __attribute__((noinline)) test26(void)
+    gc_collect()
+    uint64_t collections = gc_collections_count()
+    test_equal_i(gc_collect_idle(monotonic_ns() + 1000000000), GC_IDLE_NOT_NEEDED)
+    make_bytes(10 * MB / 1000) // more than a quarter of the growth of 16 MB
+    test_equal_i(gc_collect_idle(monotonic_ns()), GC_IDLE_NO_TIME)
+    test_equal_i(gc_collections_count(), collections)
+    uint64_t start = monotonic_ns()
+    test_equal_i(gc_collect_idle(start + 1000000000), GC_IDLE_COLLECTED)
+    printf("idle collection: %g ms\n", (monotonic_ns() - start) * 1e-6)
+    test_equal_i(gc_collections_count(), collections + 1)
+    test_equal_i(gc_collect_idle(monotonic_ns() + 1000000000), GC_IDLE_NOT_NEEDED)
+
+/*
+Builds a temporary list of n nodes in a region. If escape is true, the list is
+returned, otherwise it becomes garbage as a whole.
+*/
+Node* __attribute__((noinline)) build_in_region(int n, bool escape)
+    gc_region_begin()
+    Node* list = make_node_list(n)
+    int count = 0
+    for Node* m = list; m != NULL; m = m->left do count++
+    test_equal_i(count, n)
+    gc_region_end()
+    return escape ? list : NULL
+
+void __attribute__((noinline)) test27(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    // the whole region is released
+    build_in_region(LIST_LENGTH, false)
+    clock_t time = clock()
+    gc_collect()
+    time = clock() - time
+    printf("release region of %d nodes: %g ms\n", LIST_LENGTH, time * 1000.0 / CLOCKS_PER_SEC)
+    test_equal_i(gc_allocated_bytes(), 0)
+
+    // the same garbage without a region is swept cell by cell
+    make_node_list(LIST_LENGTH)
+    time = clock()
+    gc_collect()
+    time = clock() - time
+    printf("sweep %d nodes: %g ms\n", LIST_LENGTH, time * 1000.0 / CLOCKS_PER_SEC)
+    test_equal_i(gc_allocated_bytes(), 0)
+
+    // an object escapes, the region is swept as usual
+    Node* list = build_in_region(1000, true)
+    list->left = NULL
+    gc_collect()
+    test_equal_i(list->i, 999)
+    test_equal_i(gc_allocated_bytes(), sizeof(Node))
+    Node* n = leaf(1) // reuses a freed cell of the region
+    test_equal_i(gc_allocated_bytes(), 2 * sizeof(Node))
+    test_equal_i(list->i + n->i, 1000)
+
+/*
+Objects that were allocated since the last collection are still in the allocation
+log. Roots and handles recognize them as objects without a collection and
+without searching the log linearly.
+*/
+#define LOGGED_COUNT 20000
+#define LOGGED_SIZE 300 // too large for a cell, has a header
+void* logged[LOGGED_COUNT]
+gc_handle_t logged_handle
+
+void __attribute__((noinline)) make_logged(void)
+    uint64_t collections = gc_collections_count()
+    for int i = 0; i < LOGGED_COUNT; i++ do
+        logged[i] = gc_alloc(LOGGED_SIZE)
+        *(int*)logged[i] = i
+    clock_t time = clock()
+    for int i = 0; i < LOGGED_COUNT; i++ do gc_add_root(logged[i])
+    time = clock() - time
+    printf("add %d logged roots: %g ms\n", LOGGED_COUNT, time * 1000.0 / CLOCKS_PER_SEC)
+    logged_handle = gc_new_handle(logged[0])
+    gc_handle_set(logged_handle, logged[LOGGED_COUNT - 1])
+    test_equal_i(gc_collections_count(), collections) // all still logged
+    for int i = 0; i < LOGGED_COUNT; i++ do
+        test_equal_i(gc_contains_root(logged[i]), true)
+
+void __attribute__((noinline)) test28(void)
+    make_logged()
+    gc_collect()
+    for int i = 0; i < LOGGED_COUNT; i++ do
+        test_equal_i(*(int*)logged[i], i)
+        gc_remove_root(logged[i])
+    test_equal_i(*(int*)gc_handle_get(logged_handle), LOGGED_COUNT - 1)
+    gc_free_handle(logged_handle)
+    memset(logged, 0, sizeof(logged))
+
+/*
+The collector's own globals, such as the heap bounds, are not scanned as roots
+with data segment scanning. A new large object is mapped at the lowest address
+of the heap, so the lower heap bounds point to its start and would retain it.
+*/
+void __attribute__((noinline)) make_large_garbage(void)
+    char* s = gc_alloc(1024 * 1024)
+    s[0] = 'x'
+    for int i = 0; i < 100; i++ do leaf(i)
+
+void __attribute__((noinline)) test29(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    gc_set_scan_data_segments(true)
+    make_large_garbage()
+    gc_collect()
+    test_equal_i(gc_allocated_bytes(), 0)
+    test_equal_i(gc_is_empty(), true)
+    gc_set_scan_data_segments(false)
+
+/*
+In precise mode, creating an ephemeron table keeps its entries alive while the
+table itself is allocated. With a soft limit of 1 byte, the first allocation of
+the empty heap exceeds the threshold, so the second one collects.
+*/
+void __attribute__((noinline)) test30(void)
+    if node_type == 0 do
+        node_type = make_node_type()
+        printf("node_type = %d\n", node_type)
+    gc_set_precise_stack(true)
+    gc_set_soft_limit(1)
+    gc_collect()
+    GC_FRAME
+    uint64_t collections = gc_collections_count()
+    void* table = gc_new_ephemeron_table()
+    GC_LOCAL(table)
+    test_equal_i(gc_collections_count() - collections >= 1, true)
+    Node* key = leaf(1)
+    GC_LOCAL(key)
+    Node* value = leaf(2)
+    GC_LOCAL(value)
+    gc_ephemeron_put(table, key, value)
+    gc_collect()
+    test_equal_i(((Node*)gc_ephemeron_get(table, key))->i, 2)
+    gc_set_soft_limit(0)
+    gc_set_precise_stack(false)
+
 int main(void)
     PLf("frame address = %p", __builtin_frame_address(0))
     gc_set_bottom_of_stack(__builtin_frame_address(0))
@@ -394,5 +1451,83 @@ int main(void)
     test_freed_count += freed_count
     // test_equal_i(test_freed_count, 11)
     test_equal_i(gc_is_empty(), true)
+    test5()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test6()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test7()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test8()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test9()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test10()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test11()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test12()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test13()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test14()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test15()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test16()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test17()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test18()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test19()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test20()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test21()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test22()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test23()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test24()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test25()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test26()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test27()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test28()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test29()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
+    test30()
+    gc_collect()
+    test_equal_i(gc_is_empty(), true)
 
     return 0
@@ -0,0 +1,61 @@
+/*
+@author: Michael Rohs
+@date: January 19, 2022
+*/
+
+#ifndef gc_trace_h_INCLUDED
+#define gc_trace_h_INCLUDED
+
+#include "gc.h"
+
+/*
+GC_DEFINE_TYPE(T, f1, f2, ...) defines a trace function and a type constructor
+for struct T with managed pointer fields f1, f2, ... (at most 8). The trace
+function calls gc_trace_pointer for each field directly, instead of having the
+collector interpret the pointer offsets of the type. Use at file level:
+
+    typedef struct Tree Tree
+    struct Tree
+        int i
+        Tree* left
+        Tree* right
+
+    GC_DEFINE_TYPE(Tree, left, right)
+
+    int tree_type = 0
+
+    Tree* new_tree(void)
+        if tree_type == 0 do tree_type = Tree_gc_new_type()
+        return gc_alloc_object(tree_type)
+*/
+#define GC_DEFINE_TYPE(T, ...) \
+    void T##_gc_trace(void* o) { \
+        T* x = o; \
+        GC_FOR_EACH_(GC_TRACE_FIELD_, T, __VA_ARGS__) \
+    } \
+    int T##_gc_new_type(void) { \
+        int offsets[] = { GC_FOR_EACH_(GC_OFFSET_FIELD_, T, __VA_ARGS__) }; \
+        int count = sizeof(offsets) / sizeof(offsets[0]); \
+        int type = gc_new_type(sizeof(T), count); \
+        for (int i = 0; i < count; i++) gc_set_offset(type, i, offsets[i]); \
+        gc_set_trace_fn(type, T##_gc_trace); \
+        return type; \
+    } \
+    typedef int T##_gc_defined_
+
+#define GC_TRACE_FIELD_(T, f) gc_trace_pointer(x->f);
+#define GC_OFFSET_FIELD_(T, f) offsetof(T, f),
+
+// GC_FOR_EACH_(m, T, a1, ..., an) expands to m(T, a1) ... m(T, an)
+#define GC_FOR_EACH_(m, T, ...) GC_FOR_EACH_N_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1)(m, T, __VA_ARGS__)
+#define GC_FOR_EACH_N_(a1, a2, a3, a4, a5, a6, a7, a8, n, ...) GC_FOR_EACH_##n##_
+#define GC_FOR_EACH_1_(m, T, a) m(T, a)
+#define GC_FOR_EACH_2_(m, T, a, ...) m(T, a) GC_FOR_EACH_1_(m, T, __VA_ARGS__)
+#define GC_FOR_EACH_3_(m, T, a, ...) m(T, a) GC_FOR_EACH_2_(m, T, __VA_ARGS__)
+#define GC_FOR_EACH_4_(m, T, a, ...) m(T, a) GC_FOR_EACH_3_(m, T, __VA_ARGS__)
+#define GC_FOR_EACH_5_(m, T, a, ...) m(T, a) GC_FOR_EACH_4_(m, T, __VA_ARGS__)
+#define GC_FOR_EACH_6_(m, T, a, ...) m(T, a) GC_FOR_EACH_5_(m, T, __VA_ARGS__)
+#define GC_FOR_EACH_7_(m, T, a, ...) m(T, a) GC_FOR_EACH_6_(m, T, __VA_ARGS__)
+#define GC_FOR_EACH_8_(m, T, a, ...) m(T, a) GC_FOR_EACH_7_(m, T, __VA_ARGS__)
+
+#endif